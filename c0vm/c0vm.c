@@ -1,7 +1,10 @@
+#define _POSIX_C_SOURCE 200809L  /* putc_unlocked */
+
 #include <assert.h>
 #include <stdio.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib/xalloc.h"
 #include "lib/stack.h"
@@ -9,39 +12,116 @@
 #include "lib/c0v_stack.h"
 #include "lib/c0vm.h"
 #include "lib/c0vm_c0ffi.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_dlnative.h"
+#include "lib/c0vm_natives.h"
 #include "lib/c0vm_abort.h"
+#include "lib/c0vm_optimize.h"
+#include "lib/c0vm_profile.h"
+#include "lib/c0vm_sample.h"
+#include "lib/c0vm_trace.h"
+#include "lib/c0vm_coverage.h"
+#include "lib/c0vm_heapprof.h"
+#include "lib/c0vm_replay.h"
 
 /* call stack frames */
-typedef struct frame_info frame;
-struct frame_info {
-  c0v_stack_t S; /* Operand stack of C0 values */
-  ubyte *P;      /* Function body */
-  size_t pc;     /* Program counter */
-  c0_value *V;   /* The local variables */
-};
+typedef struct c0vm_frame frame;
+
+/* Charge a back-edge or call against the quantum, yielding when it runs
+ * out.  Only these can repeat, so every loop is counted. */
+#define TICK()                                  \
+  do {                                          \
+    if (--budget == 0) {                        \
+      ctx->fn = fn;                             \
+      ctx->P = P;                               \
+      ctx->pc = pc;                             \
+      return C0VM_YIELDED;                      \
+    }                                           \
+  } while (0)
+
+int execute(struct c0vm_context *ctx) {
+  REQUIRES(ctx != NULL && ctx->bc0 != NULL);
+
+  /* Taking or restoring a snapshot may have left ctx waiting on a
+   * native, or already finished */
+  if (ctx->pending_args != NULL) complete_native(ctx);
+  while (!ctx->done)
+    if (execute_quantum(ctx, 0) == C0VM_BLOCKED) complete_native(ctx);
+  return val2int(ctx->result);
+}
+
+static c0_value call_native(struct c0vm_context *ctx, uint16_t idx,
+                            c0_value *args) {
+  if (c0_replaying && replay_logged(idx)) return replay_native(ctx, idx);
+  c0_value result = ctx->natives[idx] != NULL
+    ? (ctx->natives[idx])(ctx, args)
+    : (native_function(idx))(args);
+  if (c0_recording && replay_logged(idx)) record_native(idx, result);
+  return result;
+}
+
+/* Output for the print intrinsics, straight into ctx->out's buffer */
+
+static inline void out_string(FILE *f, const char *s) {
+  if (s == NULL) return;
+  for (; *s != '\0'; s++) putc_unlocked(*s, f);
+}
+
+static void out_int(FILE *f, int32_t x) {
+  char digits[12];
+  int n = 0;
+  uint32_t u = x < 0 ? -(uint32_t)x : (uint32_t)x;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (x < 0) putc_unlocked('-', f);
+  while (n > 0) putc_unlocked(digits[--n], f);
+}
+
+static inline char *val2str(c0_value v) {
+  char *s = val2ptr(v);
+  return s == NULL ? "" : s;
+}
 
-int execute(struct bc0_file *bc0) {
-  REQUIRES(bc0 != NULL);
+void complete_native(struct c0vm_context *ctx) {
+  REQUIRES(ctx != NULL && ctx->pending_args != NULL);
+
+  c0v_push(ctx->S, call_native(ctx, ctx->pending_native, ctx->pending_args));
+  free(ctx->pending_args);
+  ctx->pending_args = NULL;
+}
+
+enum c0vm_status execute_quantum(struct c0vm_context *ctx, size_t quantum) {
+  REQUIRES(ctx != NULL && ctx->bc0 != NULL);
+  REQUIRES(!ctx->done && ctx->pending_args == NULL);
+  struct bc0_file *bc0 = ctx->bc0;
+  size_t budget = quantum == 0 ? SIZE_MAX : quantum;
 
   /* Variables */
-  c0v_stack_t S = c0v_stack_new(); /* Operand stack of C0 values */
-  ubyte *P = bc0->function_pool->code;      /* The array of bytes that make up the current function */
-  size_t pc = 0;     /* Your current location within the current byte array P */
-  c0_value *V = xcalloc(bc0->function_pool->num_vars, sizeof(c0_value));
-  (void) V;
+  c0v_stack_t S = ctx->S; /* Operand stack of C0 values */
+  size_t fn = ctx->fn;    /* The index of the current function */
+  ubyte *P = ctx->P;      /* The array of bytes that make up the current function */
+  size_t pc = ctx->pc;    /* Your current location within the current byte array P */
+  c0_value *V = ctx->V;   /* The local variables */
 
   /* The call stack, a generic stack that should contain pointers to frames */
-  /* You won't need this until you implement functions. */
-  gstack_t callStack = stack_new();
-  (void) callStack;
+  gstack_t callStack = ctx->call_stack;
+
+  if (!ctx->started) {
+    ctx->started = true;
+    if (c0_profiling) profile_call(fn);
+    if (c0_sampling) sample_call(fn);
+  }
 
   while (true) {
 
-#ifdef DEBUG
-    /* You can add extra debugging information here */
-    fprintf(stderr, "Opcode %x -- Stack size: %zu -- PC: %zu\n",
-            P[pc], c0v_stack_size(S), pc);
-#endif
+    if (c0_profiling) profile_insn(P[pc]);
+    if (c0_sampling) sample_pc(pc);
+    if (c0_coverage) coverage_insn(fn, pc, P[pc]);
+
+    if (c0_tracing)
+      trace_insn(fn, pc, P[pc], c0v_stack_size(S), stack_size(callStack));
 
     switch (P[pc]) {
 
@@ -82,6 +162,8 @@ int execute(struct bc0_file *bc0) {
     case RETURN: {
       c0_value retval = c0v_pop(S);
       assert(c0v_stack_empty(S));
+      if (c0_profiling) profile_return();
+      if (c0_sampling) sample_return();
 #ifdef DEBUG
       fprintf(stderr, "Returning %d from execute()\n", val2int(retval));
 #endif
@@ -89,17 +171,21 @@ int execute(struct bc0_file *bc0) {
 
       if(stack_empty(callStack)) {
         c0v_stack_free(S);
-        stack_free(callStack, NULL);
         free(V);
-        return val2int(retval);
+        ctx->S = NULL;
+        ctx->V = NULL;
+        ctx->result = retval;
+        ctx->done = true;
+        return C0VM_DONE;
 
         }
       else {
         free(V);
         frame *retFrame = pop(callStack);
         c0v_stack_free(S);
-        V = retFrame->V;
-        S = retFrame->S;
+        V = ctx->V = retFrame->V;
+        S = ctx->S = retFrame->S;
+        fn = retFrame->fn;
         P = retFrame->P;
         pc = retFrame->pc;
         c0v_push(S, retval);
@@ -280,7 +366,9 @@ int execute(struct bc0_file *bc0) {
       int o1 = P[pc+1];
       int o2 = P[pc+2];
       if(val_equal(v1,v2)) {
-        pc = pc + (int16_t)(o1<<8|o2);
+        int16_t offset = (int16_t)(o1<<8|o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -295,7 +383,9 @@ int execute(struct bc0_file *bc0) {
       int o1 = P[pc+1];
       int o2 = P[pc+2];
       if(!val_equal(v1,v2)) {
-        pc = pc + (o1<<8|o2);
+        int16_t offset = (int16_t)(o1<<8|o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -310,7 +400,9 @@ int execute(struct bc0_file *bc0) {
       int o1 = P[pc+1];
       int o2 = P[pc+2];
       if(v2 < v1) {
-        pc = pc + (o1<<8 | o2);
+        int16_t offset = (int16_t)(o1<<8 | o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -326,7 +418,9 @@ int execute(struct bc0_file *bc0) {
       int o1 = P[pc+1];
       int o2 = P[pc+2];
       if(v2 >= v1) {
-        pc = pc + (o1<<8 | o2);
+        int16_t offset = (int16_t)(o1<<8 | o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -341,7 +435,9 @@ int execute(struct bc0_file *bc0) {
       int o1 = P[pc+1];
       int o2 = P[pc+2];
       if(v2 > v1) {
-        pc = pc + (o1<<8 | o2);
+        int16_t offset = (int16_t)(o1<<8 | o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -357,7 +453,9 @@ int execute(struct bc0_file *bc0) {
       int32_t o1 = P[pc+1];
       uint32_t o2 = P[pc+2];
       if(v2 <= v1) {
-        pc = pc + (int16_t)(o1<<8 | o2);
+        int16_t offset = (int16_t)(o1<<8 | o2);
+        pc = pc + offset;
+        if (offset < 0) TICK();
         }
       else {
         pc = pc + 3;
@@ -368,7 +466,9 @@ int execute(struct bc0_file *bc0) {
     case GOTO: {
       int32_t o1 = P[pc+1];
       uint32_t o2 = P[pc+2];
-      pc = pc + (int16_t)(o1<<8 | o2);
+      int16_t offset = (int16_t)(o1<<8 | o2);
+      pc = pc + offset;
+      if (offset < 0) TICK();
       break;
       }
 
@@ -398,11 +498,15 @@ int execute(struct bc0_file *bc0) {
       frame *curFrame = xmalloc(sizeof(frame));
       curFrame->V = V;
       curFrame->S = S;
+      curFrame->fn = fn;
       curFrame->P = P;
       curFrame->pc = pc + 3;
       push(callStack, curFrame);
 
-      struct function_info *finfo = &bc0->function_pool[(uint32_t)(c1<<8|c2)];
+      fn = c1<<8|c2;
+      struct function_info *finfo = &bc0->function_pool[fn];
+      if (c0_profiling) profile_call(fn);
+      if (c0_sampling) sample_call(fn);
       c0_value *Vn = xmalloc(finfo->num_vars * sizeof(c0_value));
 
       for(int i = 0; i < finfo->num_args; i++) {
@@ -410,14 +514,16 @@ int execute(struct bc0_file *bc0) {
         }
 
 
-      V = Vn;
-      S = c0v_stack_new();
+      V = ctx->V = Vn;
+      S = ctx->S = c0v_stack_new();
       P = finfo->code;
       pc = 0;
+      TICK();
       break;
       }
 
-    case INVOKENATIVE: {
+    case INVOKENATIVE:
+    invokenative: {
       uint32_t c1 = P[pc+1];
       uint32_t c2 = P[pc+2];
       struct native_info *ninfo = &bc0->native_pool[(c1<<8|c2)];
@@ -425,8 +531,20 @@ int execute(struct bc0_file *bc0) {
       for(int i = 0; i < ninfo->num_args; i++) {
         Vn[ninfo->num_args-1-i] = c0v_pop(S);
         }
-      c0v_push(S, (native_function_table[ninfo->function_table_index])(Vn));
+      uint16_t idx = ninfo->function_table_index;
       pc = pc + 3;
+      if ((ctx->defer_blocking && native_blocks(idx))
+          || idx == ctx->stop_native) {
+        ctx->pending_native = idx;
+        ctx->pending_args = Vn;
+        ctx->fn = fn;
+        ctx->P = P;
+        ctx->pc = pc;
+        return C0VM_BLOCKED;
+      }
+      ctx->native_args = Vn;
+      c0v_push(S, call_native(ctx, idx, Vn));
+      ctx->native_args = NULL;
       free(Vn);
       break;
       }
@@ -437,7 +555,8 @@ int execute(struct bc0_file *bc0) {
 
     case NEW: {
       uint32_t s = P[pc+1];
-      c0v_push(S, ptr2val(xmalloc(s)));
+      if (c0_heap_profiling) heapprof_alloc(fn, pc, s);
+      c0v_push(S, ptr2val(c0vm_alloc(ctx, s)));
       pc = pc + 2;
       break;
       }
@@ -446,7 +565,9 @@ int execute(struct bc0_file *bc0) {
       int32_t n = val2int(c0v_pop(S));
       if(n < 0) c0_memory_error("Invalid number of elements");
       int32_t s = P[pc+1];
-      struct c0_array_header *a = xcalloc(1,(n * s) + sizeof(struct c0_array_header));
+      if (c0_heap_profiling)
+        heapprof_alloc(fn, pc, (size_t)n * s + sizeof(struct c0_array_header));
+      struct c0_array_header *a = c0vm_alloc(ctx, (size_t)n * s + sizeof(struct c0_array_header));
       a->count = n;
       a->elt_size = s;
       c0v_push(S, ptr2val(a));
@@ -543,6 +664,130 @@ int execute(struct bc0_file *bc0) {
       }
 
 
+    /* Array idioms recognized by the optimizer.  If the loop can't be
+     * run in bulk, execute the vload they replaced instead. */
+
+    case AFILL: {
+      if (idiom_fill(P, pc, V, &pc)) break;
+      c0v_push(S, V[P[pc+1]]);
+      pc = pc + 2;
+      break;
+      }
+
+    case ACOPY: {
+      if (idiom_copy(P, pc, V, &pc)) break;
+      c0v_push(S, V[P[pc+1]]);
+      pc = pc + 2;
+      break;
+      }
+
+    case ASEARCH: {
+      if (idiom_search(P, pc, V, &pc)) break;
+      c0v_push(S, V[P[pc+1]]);
+      pc = pc + 2;
+      break;
+      }
+
+
+    /* Intrinsic natives recognized by the optimizer.  A context whose
+     * natives the host has replaced executes the invokenative instead. */
+
+    case STRLEN: {
+      if (!ctx->intrinsics) goto invokenative;
+      char *s = val2str(c0v_pop(S));
+      c0v_push(S, int2val((int32_t)strlen(s)));
+      pc = pc + 3;
+      break;
+      }
+
+    case STRCHARAT: {
+      if (!ctx->intrinsics) goto invokenative;
+      int32_t i = val2int(c0v_pop(S));
+      char *s = val2str(c0v_pop(S));
+      if (i < 0 || memchr(s, '\0', (size_t)i + 1) != NULL)
+        c0_assertion_failure("string_charat: index out of bounds");
+      c0v_push(S, int2val((uint8_t)s[i]));
+      pc = pc + 3;
+      break;
+      }
+
+    case STREQ: {
+      if (!ctx->intrinsics) goto invokenative;
+      char *b = val2str(c0v_pop(S));
+      char *a = val2str(c0v_pop(S));
+      c0v_push(S, int2val(strcmp(a, b) == 0));
+      pc = pc + 3;
+      break;
+      }
+
+    case STRCMP: {
+      if (!ctx->intrinsics) goto invokenative;
+      char *b = val2str(c0v_pop(S));
+      char *a = val2str(c0v_pop(S));
+      int r = strcmp(a, b);
+      c0v_push(S, int2val(r < 0 ? -1 : r > 0));
+      pc = pc + 3;
+      break;
+      }
+
+    case CHARORD: {
+      if (!ctx->intrinsics) goto invokenative;
+      pc = pc + 3;  /* chars are already ints on the stack */
+      break;
+      }
+
+    case CHARCHR: {
+      if (!ctx->intrinsics) goto invokenative;
+      int32_t c = val2int(c0v_pop(S));
+      if (c < 0 || c > 127)
+        c0_assertion_failure("char_chr: not an ASCII character");
+      c0v_push(S, int2val(c));
+      pc = pc + 3;
+      break;
+      }
+
+    case PRINTS: {
+      if (!ctx->intrinsics) goto invokenative;
+      out_string(ctx->out, val2ptr(c0v_pop(S)));
+      c0v_push(S, int2val(0));
+      pc = pc + 3;
+      break;
+      }
+
+    case PRINTLN: {
+      if (!ctx->intrinsics) goto invokenative;
+      out_string(ctx->out, val2ptr(c0v_pop(S)));
+      putc_unlocked('\n', ctx->out);
+      c0v_push(S, int2val(0));
+      pc = pc + 3;
+      break;
+      }
+
+    case PRINTINT: {
+      if (!ctx->intrinsics) goto invokenative;
+      out_int(ctx->out, val2int(c0v_pop(S)));
+      c0v_push(S, int2val(0));
+      pc = pc + 3;
+      break;
+      }
+
+    case PRINTCHAR: {
+      if (!ctx->intrinsics) goto invokenative;
+      putc_unlocked(val2int(c0v_pop(S)), ctx->out);
+      c0v_push(S, int2val(0));
+      pc = pc + 3;
+      break;
+      }
+
+    case PRINTBOOL: {
+      if (!ctx->intrinsics) goto invokenative;
+      out_string(ctx->out, val2int(c0v_pop(S)) ? "true" : "false");
+      c0v_push(S, int2val(0));
+      pc = pc + 3;
+      break;
+      }
+
+
     default:
       fprintf(stderr, "invalid opcode: 0x%02x\n", P[pc]);
       abort();
@@ -0,0 +1,349 @@
+/* C0VM batch runner
+ *
+ * Runs many jobs -- a bc0 program with arguments, standard input and
+ * expected output -- concurrently in one process, on the scheduler's
+ * pool of threads.  Each distinct program is loaded and optimized once
+ * and shared by all of its jobs; each job gets its own context, with its
+ * input read into memory, its output captured in memory and its C0
+ * errors trapped rather than ending the process.
+ *
+ * The manifest has one job per line, with tab-separated fields
+ *   program.bc0 <TAB> args <TAB> stdin file <TAB> expected output file
+ * where args are separated by spaces, and a missing field or "-" means
+ * none.  Blank lines and lines starting with # are ignored.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lib/xalloc.h"
+#include "lib/c0vm.h"
+#include "lib/c0vm_abort.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_dlnative.h"
+#include "lib/c0vm_optimize.h"
+#include "lib/c0vm_sched.h"
+
+/* for the args library */
+int c0_argc;
+char **c0_argv;
+
+struct program {
+  char *path;
+  struct bc0_file *bc0;
+  char *error;             /* why its jobs can't run, or NULL */
+  struct program *next;
+};
+
+enum job_status { JOB_PASS, JOB_FAIL, JOB_ERROR };
+
+struct job {
+  size_t line;             /* in the manifest */
+  struct program *prog;
+  int argc;                /* argv[0] is the program's path */
+  char **argv;
+  char *input;             /* NULL for none */
+  char *expected;          /* NULL for none */
+
+  char *input_buf;
+  enum job_status status;
+  int result;
+  char *output;
+  size_t output_len;
+  char error[320];
+  double started;
+  double seconds;          /* from start to finish, including waiting */
+};
+
+static struct program *programs = NULL;
+static struct job *jobs = NULL;
+static size_t job_count = 0;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *copy_string(const char *s) {
+  char *c = xmalloc(strlen(s) + 1);
+  strcpy(c, s);
+  return c;
+}
+
+/* Whole contents of a file, or NULL if it can't be read */
+static char *slurp(const char *filename, size_t *len) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return NULL;
+  size_t cap = 4096;
+  char *buf = xmalloc(cap);
+  *len = 0;
+  size_t n;
+  while ((n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+    *len += n;
+    if (*len == cap) {
+      cap *= 2;
+      char *bigger = xmalloc(cap);
+      memcpy(bigger, buf, *len);
+      free(buf);
+      buf = bigger;
+    }
+  }
+  fclose(f);
+  return buf;
+}
+
+/*** Loading ***/
+
+static struct program *load(const char *path) {
+  for (struct program *p = programs; p != NULL; p = p->next)
+    if (strcmp(p->path, path) == 0) return p;
+
+  struct program *p = xmalloc(sizeof(struct program));
+  p->path = copy_string(path);
+  p->bc0 = read_program(p->path);
+  uint16_t vers = p->bc0->version >> 1;
+  if (BYTECODE_VERSION != vers) {
+    fprintf(stderr, "Error: %s: implementation version %u != code version %u\n",
+            path, BYTECODE_VERSION, vers);
+    exit(EXIT_FAILURE);
+  }
+  /* A missing library fails this program's jobs, not the whole batch */
+  char err[256];
+  p->error = NULL;
+  if (!natives_load(p->bc0, err, sizeof(err))) p->error = copy_string(err);
+  optimize_program(p->bc0);
+  p->next = programs;
+  programs = p;
+  return p;
+}
+
+static char *field(char **rest) {
+  char *f = *rest;
+  if (f == NULL) return NULL;
+  char *tab = strchr(f, '\t');
+  if (tab != NULL) {
+    *tab = '\0';
+    *rest = tab + 1;
+  } else {
+    *rest = NULL;
+  }
+  return f[0] == '\0' || strcmp(f, "-") == 0 ? NULL : f;
+}
+
+static void parse_job(struct job *j, char *line, size_t lineno) {
+  char *rest = line;
+  char *program = field(&rest);
+  char *args = field(&rest);
+  char *input = field(&rest);
+  char *expected = field(&rest);
+  if (program == NULL) {
+    fprintf(stderr, "Error: manifest line %zu: no program\n", lineno);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(j, 0, sizeof(struct job));
+  j->line = lineno;
+  j->prog = load(program);
+  j->input = input == NULL ? NULL : copy_string(input);
+  j->expected = expected == NULL ? NULL : copy_string(expected);
+
+  size_t max = 2 + (args == NULL ? 0 : strlen(args));
+  j->argv = xcalloc(max, sizeof(char *));
+  j->argv[j->argc++] = j->prog->path;
+  for (char *a = args == NULL ? NULL : strtok(args, " "); a != NULL;
+       a = strtok(NULL, " "))
+    j->argv[j->argc++] = copy_string(a);
+}
+
+static void read_manifest(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t cap = 64;
+  jobs = xcalloc(cap, sizeof(struct job));
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  size_t lineno = 0;
+  while ((len = getline(&line, &linecap, f)) >= 0) {
+    lineno++;
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#') continue;
+    if (job_count == cap) {
+      struct job *bigger = xcalloc(2 * cap, sizeof(struct job));
+      memcpy(bigger, jobs, cap * sizeof(struct job));
+      free(jobs);
+      jobs = bigger;
+      cap *= 2;
+    }
+    parse_job(&jobs[job_count++], line, lineno);
+  }
+  free(line);
+  fclose(f);
+}
+
+/*** Running ***/
+
+static void job_done(struct c0vm_context *ctx, int result,
+                     const char *error, void *arg) {
+  struct job *j = arg;
+  j->result = result;
+  if (error == NULL) {
+    j->status = JOB_PASS;
+  } else {
+    j->status = JOB_ERROR;
+    snprintf(j->error, sizeof(j->error), "%s", error);
+  }
+  fclose(ctx->in);
+  fclose(ctx->out);
+  c0vm_context_free(ctx);
+  free(j->input_buf);
+
+  if (j->status == JOB_PASS && j->expected != NULL) {
+    size_t len;
+    char *expected = slurp(j->expected, &len);
+    if (expected == NULL) {
+      j->status = JOB_ERROR;
+      snprintf(j->error, sizeof(j->error), "can't read %s", j->expected);
+    } else if (len != j->output_len || memcmp(expected, j->output, len) != 0) {
+      size_t k = 0;
+      while (k < len && k < j->output_len && expected[k] == j->output[k]) k++;
+      j->status = JOB_FAIL;
+      snprintf(j->error, sizeof(j->error),
+               "output differs from %s at byte %zu", j->expected, k);
+    }
+    free(expected);
+  }
+  j->seconds = now() - j->started;
+}
+
+/* Input is read up front so that waiting jobs don't hold descriptors */
+static void start_job(struct c0vm_sched *sched, struct job *j) {
+  j->started = now();
+  if (j->prog->error != NULL) {
+    j->status = JOB_ERROR;
+    snprintf(j->error, sizeof(j->error), "%s", j->prog->error);
+    return;
+  }
+  size_t len = 0;
+  if (j->input == NULL) {
+    j->input_buf = xcalloc(1, 1);
+  } else if ((j->input_buf = slurp(j->input, &len)) == NULL) {
+    j->status = JOB_ERROR;
+    snprintf(j->error, sizeof(j->error), "can't read %s: %s",
+             j->input, strerror(errno));
+    return;
+  }
+
+  struct c0vm_context *ctx = c0vm_context_new(j->prog->bc0, j->argc, j->argv);
+  ctx->in = fmemopen(j->input_buf, len, "r");
+  ctx->out = open_memstream(&j->output, &j->output_len);
+  if (ctx->in == NULL || ctx->out == NULL) {
+    perror("c0vm-batch");
+    exit(EXIT_FAILURE);
+  }
+  sched_spawn(sched, ctx, job_done, j);
+}
+
+/*** Reporting ***/
+
+static void save_output(const char *dir, struct job *j) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%zu.out", dir, j->line);
+  FILE *f = fopen(path, "wb");
+  if (f == NULL || fwrite(j->output, 1, j->output_len, f) < j->output_len) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "usage: %s [-j threads] [-b blocking_threads] "
+          "[-q quantum] [-o output_dir] [-v] <manifest>\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long blockers = 4;
+  long quantum = 10000;  /* back-edges and calls */
+  char *outdir = NULL;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:b:q:o:v")) != -1) {
+    switch (opt) {
+    case 'j': threads = atol(optarg); break;
+    case 'b': blockers = atol(optarg); break;
+    case 'q': quantum = atol(optarg); break;
+    case 'o': outdir = optarg; break;
+    case 'v': verbose = true; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || threads < 1 || blockers < 1 || quantum < 0)
+    usage(argv[0]);
+
+  double start = now();
+  read_manifest(argv[optind]);
+  double loaded = now();
+
+  struct c0vm_sched *sched = sched_new(threads, blockers, quantum);
+  for (size_t k = 0; k < job_count; k++) start_job(sched, &jobs[k]);
+  sched_wait(sched);
+  sched_free(sched);
+  double finished = now();
+
+  size_t count[3] = {0, 0, 0};
+  static const char *label[3] = {"PASS", "FAIL", "ERROR"};
+  for (size_t k = 0; k < job_count; k++) {
+    struct job *j = &jobs[k];
+    count[j->status]++;
+    if (outdir != NULL) save_output(outdir, j);
+    if (j->status == JOB_PASS && !verbose) continue;
+    printf("%-5s line %zu: %s", label[j->status], j->line, j->prog->path);
+    for (int a = 1; a < j->argc; a++) printf(" %s", j->argv[a]);
+    if (j->status == JOB_PASS)
+      printf(" => %d (%.3fs)\n", j->result, j->seconds);
+    else
+      printf(": %s\n", j->error);
+  }
+
+  size_t nprograms = 0;
+  for (struct program *p = programs; p != NULL; p = p->next) nprograms++;
+  printf("%zu jobs: %zu passed, %zu failed, %zu errors\n",
+         job_count, count[JOB_PASS], count[JOB_FAIL], count[JOB_ERROR]);
+  printf("loaded %zu programs in %.3fs, ran on %ld threads in %.3fs "
+         "(%.1f jobs/s)\n", nprograms, loaded - start, threads,
+         finished - loaded,
+         finished > loaded ? job_count / (finished - loaded) : 0.0);
+
+  for (size_t k = 0; k < job_count; k++) {
+    for (int a = 1; a < jobs[k].argc; a++) free(jobs[k].argv[a]);
+    free(jobs[k].argv);
+    free(jobs[k].input);
+    free(jobs[k].expected);
+    free(jobs[k].output);
+  }
+  free(jobs);
+  while (programs != NULL) {
+    struct program *next = programs->next;
+    free_program(programs->bc0);
+    free(programs->path);
+    free(programs->error);
+    free(programs);
+    programs = next;
+  }
+
+  return count[JOB_FAIL] + count[JOB_ERROR] == 0 ? 0 : 1;
+}
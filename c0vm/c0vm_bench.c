@@ -0,0 +1,222 @@
+/* C0VM benchmark harness
+ *
+ * c0vm-bench [-w warmup] [-r repetitions] [-b baseline_vm] <vm> <bc0>...
+ * runs each bc0 program under vm, warmup times untimed and then
+ * repetitions times, and reports the median and fastest wall time, the
+ * instructions executed, ns per instruction, allocations in the C0 heap
+ * and peak RSS.  With -b, runs alternate between vm and baseline_vm and
+ * the report compares them.
+ *
+ * Programs run with no arguments, standard input and output on
+ * /dev/null, and the C0_* variables that slow the VM down unset.
+ * Instructions and allocations come from one extra run with C0_PROFILE
+ * set; builds too old to count allocations show "-".
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "lib/xalloc.h"
+
+/* Would make the timed runs measure something else */
+static const char *unset[] = {
+  "C0_PROFILE", "C0_SAMPLE", "C0_SAMPLE_HZ", "C0_TRACE", "C0_TRACE_SIZE",
+  "C0_COVERAGE", "C0_RESULT_FILE", "C0_SNAPSHOT", "C0_SNAPSHOT_AT",
+  "C0_RESTORE", "C0_HEAP_PROFILE", "C0_RECORD", "C0_REPLAY",
+};
+#define UNSET_COUNT (sizeof(unset) / sizeof(unset[0]))
+
+struct result {
+  double median_ms;
+  double min_ms;
+  long peak_rss_kb;
+  int64_t insns;   /* -1 if unknown */
+  int64_t allocs;
+  int64_t alloc_bytes;
+  bool failed;
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Runs vm on program once; returns false if it didn't exit with 0 */
+static bool run(const char *vm, const char *program, const char *profile,
+                double *ms, long *rss_kb) {
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    int null = open("/dev/null", O_RDWR);
+    if (null < 0) _exit(127);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    for (size_t i = 0; i < UNSET_COUNT; i++) unsetenv(unset[i]);
+    if (profile != NULL) setenv("C0_PROFILE", profile, 1);
+    execl(vm, vm, program, (char *)NULL);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    exit(EXIT_FAILURE);
+  }
+  if (ms != NULL) *ms = (now() - start) * 1e3;
+  if (rss_kb != NULL) *rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Instructions and allocations, from a profiled run */
+static void count(const char *vm, const char *program, struct result *r) {
+  r->insns = r->allocs = r->alloc_bytes = -1;
+
+  char path[] = "/tmp/c0vm-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  if (!run(vm, program, path, NULL, NULL)) r->failed = true;
+
+  FILE *f = fopen(path, "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL && line[0] == '#') {
+      sscanf(line, "# c0vm profile: %" SCNd64, &r->insns);
+      sscanf(line, "# c0vm heap: %" SCNd64 " allocations, %" SCNd64,
+             &r->allocs, &r->alloc_bytes);
+    }
+    fclose(f);
+  }
+  unlink(path);
+}
+
+static int by_value(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void summarize(double *ms, int reps, struct result *r) {
+  qsort(ms, reps, sizeof(double), by_value);
+  r->min_ms = ms[0];
+  r->median_ms = reps % 2 == 1 ? ms[reps/2]
+                               : (ms[reps/2 - 1] + ms[reps/2]) / 2;
+}
+
+static void print_count(int64_t x) {
+  if (x < 0) printf(" %12s", "-");
+  else printf(" %12" PRId64, x);
+}
+
+static void print_result(const char *name, const char *build,
+                         struct result *r) {
+  printf("%-16s %-6s", name, build);
+  if (r->failed) {
+    printf(" FAILED");
+    return;
+  }
+  printf(" %10.2f %10.2f", r->median_ms, r->min_ms);
+  print_count(r->insns);
+  if (r->insns > 0) printf(" %8.2f", r->median_ms * 1e6 / r->insns);
+  else printf(" %8s", "-");
+  print_count(r->allocs);
+  print_count(r->alloc_bytes < 0 ? -1 : r->alloc_bytes / 1024);
+  printf(" %10ld", r->peak_rss_kb);
+}
+
+static const char *basename_of(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash == NULL ? path : slash + 1;
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "usage: %s [-w warmup] [-r repetitions] [-b baseline_vm] "
+          "<vm> <bc0_file>...\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int warmup = 1, reps = 5;
+  char *base = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:r:b:")) != -1) {
+    switch (opt) {
+    case 'w': warmup = atoi(optarg); break;
+    case 'r': reps = atoi(optarg); break;
+    case 'b': base = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind > argc - 2 || warmup < 0 || reps < 1) usage(argv[0]);
+  char *vm = argv[optind];
+  int nvms = base == NULL ? 1 : 2;
+  char *vms[2] = { vm, base };
+
+  printf("%-16s %-6s %10s %10s %12s %8s %12s %12s %10s%s\n",
+         "benchmark", "build", "median ms", "min ms", "instructions",
+         "ns/insn", "allocations", "alloc KB", "RSS KB",
+         base == NULL ? "" : "  speedup");
+
+  double *ms[2];
+  ms[0] = xcalloc(reps, sizeof(double));
+  ms[1] = xcalloc(reps, sizeof(double));
+  bool all_ok = true;
+
+  for (int p = optind + 1; p < argc; p++) {
+    char *program = argv[p];
+    struct result r[2];
+    memset(r, 0, sizeof(r));
+
+    for (int i = 0; i < warmup; i++)
+      for (int v = 0; v < nvms; v++)
+        run(vms[v], program, NULL, NULL, NULL);
+
+    /* Alternate builds, so that drift in the machine hits both */
+    for (int i = 0; i < reps; i++) {
+      for (int v = 0; v < nvms; v++) {
+        long rss;
+        if (!run(vms[v], program, NULL, &ms[v][i], &rss)) r[v].failed = true;
+        if (rss > r[v].peak_rss_kb) r[v].peak_rss_kb = rss;
+      }
+    }
+
+    for (int v = 0; v < nvms; v++) {
+      summarize(ms[v], reps, &r[v]);
+      count(vms[v], program, &r[v]);
+      if (r[v].failed) all_ok = false;
+    }
+
+    const char *name = basename_of(program);
+    print_result(name, base == NULL ? "" : "new", &r[0]);
+    if (base != NULL && !r[0].failed && !r[1].failed)
+      printf("  %6.2fx", r[1].median_ms / r[0].median_ms);
+    printf("\n");
+    if (base != NULL) {
+      print_result(name, "base", &r[1]);
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+
+  free(ms[0]);
+  free(ms[1]);
+  return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,28 @@
+/* C0VM fork-server client
+ *
+ * c0vm-client <socket> <bc0_file> [args...] runs bc0_file on a server
+ * started with c0vm --server <socket>, with this process's standard
+ * input, output and error, and exits the way the run did.  It links
+ * none of the C0 libraries, so it starts in a fraction of c0vm's time.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "lib/c0vm_server.h"
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <socket> <bc0_file> [args...]\n", argv[0]);
+    exit(1);
+  }
+
+  int status = fork_client(argv[1], argc - 2, argv + 2);
+  if (status < 0) return EXIT_FAILURE;
+  if (WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
@@ -5,13 +5,28 @@
  * Performs some OS compatibility checks before
  * running the VM.
  */
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
-#include <alloca.h>
+#include <unistd.h>
 #include "lib/c0vm.h"
+#include "lib/c0vm_context.h"
+#include "lib/c0vm_optimize.h"
+#include "lib/c0vm_profile.h"
+#include "lib/c0vm_sample.h"
+#include "lib/c0vm_trace.h"
+#include "lib/c0vm_coverage.h"
+#include "lib/c0vm_heapprof.h"
+#include "lib/c0vm_replay.h"
+#include "lib/c0vm_dlnative.h"
+#include "lib/c0vm_server.h"
+#include "lib/c0vm_snapshot.h"
 
-/* for the args library */
+/* for the args library; the VM's own args natives (c0vm_natives.c)
+ * take the arguments from the context instead */
 int c0_argc;
 char **c0_argv;
 
@@ -40,11 +55,113 @@ void xfclose(FILE *stream, char *error) {
   }
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "usage: %s <bc0_file> [args...]\n", argv[0]);
-    exit(1);
+/* With --server, a program loaded before serving and its real path */
+static struct bc0_file *preloaded = NULL;
+static char *preloaded_path = NULL;
+
+static struct bc0_file *load(char *filename) {
+  struct bc0_file *bc0 = read_program(filename);
+  uint16_t vers = bc0->version >> 1;
+  if (BYTECODE_VERSION != vers) {
+    fprintf(stderr, "Error: implementation version %u != code version %u\n", 
+            BYTECODE_VERSION, vers);
+    exit(EXIT_FAILURE);
+  }
+  char err[256];
+  if (!natives_load(bc0, err, sizeof(err))) {
+    fprintf(stderr, "Error: %s: %s\n", filename, err);
+    exit(EXIT_FAILURE);
+  }
+
+  char *coverage = getenv("C0_COVERAGE");
+  if (coverage != NULL) coverage_init(bc0, coverage);
+  optimize_program(bc0);
+  return bc0;
+}
+
+/* Runs argv[0] with arguments argv[1..argc-1] */
+static int run(int argc, char **argv) {
+  char *filename = getenv("C0_RESULT_FILE");
+  char *profile = getenv("C0_PROFILE");
+  char *samples = getenv("C0_SAMPLE");
+  char *sample_hz = getenv("C0_SAMPLE_HZ");
+  char *trace = getenv("C0_TRACE");
+  char *trace_size = getenv("C0_TRACE_SIZE");
+  char *heap_profile = getenv("C0_HEAP_PROFILE");
+  char *snapshot = getenv("C0_SNAPSHOT");
+  char *snapshot_at = getenv("C0_SNAPSHOT_AT");
+  char *restore = getenv("C0_RESTORE");
+  char *record = getenv("C0_RECORD");
+  char *replay = getenv("C0_REPLAY");
+
+  struct bc0_file *bc0 = NULL;
+  if (preloaded_path != NULL) {
+    char *path = realpath(argv[0], NULL);
+    if (path != NULL && strcmp(path, preloaded_path) == 0) bc0 = preloaded;
+    free(path);
   }
+  if (bc0 == NULL) bc0 = load(argv[0]);
+
+  if (profile != NULL) profile_init(bc0, profile);
+  if (samples != NULL)
+    sample_init(bc0, samples, sample_hz == NULL ? 997 : atoi(sample_hz));
+  if (heap_profile != NULL) heapprof_init(bc0, heap_profile);
+  if (trace != NULL)
+    trace_init(trace, trace_size == NULL ? 1 << 20 : strtoul(trace_size, NULL, 10));
+
+  /* for the args library */
+  c0_argc = argc;
+  c0_argv = argv;
+
+  if (record != NULL && replay != NULL) {
+    fprintf(stderr, "Error: C0_RECORD and C0_REPLAY are both set\n");
+    exit(EXIT_FAILURE);
+  }
+  if (snapshot != NULL && restore != NULL) {
+    fprintf(stderr, "Error: C0_SNAPSHOT and C0_RESTORE are both set\n");
+    exit(EXIT_FAILURE);
+  }
+  if (record != NULL) record_init(bc0, argc, argv, record);
+  if (replay != NULL) replay_init(bc0, argc, argv, replay);
+
+  /* Programs that print a lot write through a large buffer of our own */
+  if (!isatty(STDOUT_FILENO)) setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  struct c0vm_context *ctx = c0vm_context_new(bc0, c0_argc, c0_argv);
+  if (restore != NULL) snapshot_restore(ctx, restore);
+  if (snapshot != NULL) {
+    if (snapshot_at == NULL) {
+      fprintf(stderr, "Error: C0_SNAPSHOT needs C0_SNAPSHOT_AT\n");
+      exit(EXIT_FAILURE);
+    }
+    snapshot_take(ctx, snapshot_at, snapshot);
+  }
+
+  if (filename == NULL) {
+    int result = execute(ctx);
+    printf("%d\n", result);
+  } else {
+    FILE *f = xfopen(filename, "w", "Couldn't open $C0_RESULT_FILE");
+    xfwrite("\0", 1, 1, f, "Couldn't write to $C0_RESULT_FILE");
+    int result = execute(ctx);
+    printf("Result = %d\n", result);
+    xfwrite(&result, sizeof(int), 1, f, "Couldn't write to $C0_RESULT_FILE");
+    xfclose(f, "Couldn't close $C0_RESULT_FILE");
+  }
+
+  c0vm_context_free(ctx);
+  if (bc0 != preloaded) free_program(bc0);
+  return 0;
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "usage: %s <bc0_file> [args...]\n"
+          "       %s --server <socket> [bc0_file]\n", name, name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) usage(argv[0]);
 
   /* test for two's complement */
   if (~(-1) != 0) {
@@ -69,40 +186,17 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  /* for the args library -- skip the binary name */
-  c0_argc = argc - 1;
-  c0_argv = argv + 1;
-
-  char *filename = getenv("C0_RESULT_FILE");
-
-  struct bc0_file *bc0 = read_program(argv[1]);
-  uint16_t vers = bc0->version >> 1;
-  if (BYTECODE_VERSION != vers) {
-    fprintf(stderr, "Error: implementation version %u != code version %u\n", 
-            BYTECODE_VERSION, vers);
-    exit(EXIT_FAILURE);
-  }
-
-  // Move string pool to stack
-  char *stack_allocate_string_pool = alloca(bc0->string_count);
-  for (size_t i = 0; i < bc0->string_count; i++) {
-    stack_allocate_string_pool[i] = bc0->string_pool[i];
-  }
-  free(bc0->string_pool);
-    bc0->string_pool = stack_allocate_string_pool;
-
-  if (filename == NULL) {
-    int result = execute(bc0);
-    printf("%d\n", result);
-  } else {
-    FILE *f = xfopen(filename, "w", "Couldn't open $C0_RESULT_FILE");
-    xfwrite("\0", 1, 1, f, "Couldn't write to $C0_RESULT_FILE");
-    int result = execute(bc0);
-    printf("Result = %d\n", result);
-    xfwrite(&result, sizeof(int), 1, f, "Couldn't write to $C0_RESULT_FILE");
-    xfclose(f, "Couldn't close $C0_RESULT_FILE");
+  /* Fork server: run each request in a child of this process */
+  if (strcmp(argv[1], "--server") == 0) {
+    if (argc < 3 || argc > 4) usage(argv[0]);
+    natives_preload();
+    if (argc == 4) {
+      preloaded = load(argv[3]);
+      preloaded_path = realpath(argv[3], NULL);
+    }
+    fork_server(argv[2], run);
   }
 
-  free_program(bc0);
-  return 0;
+  /* skip the binary name */
+  return run(argc - 1, argv + 1);
 }
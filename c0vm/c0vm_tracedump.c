@@ -0,0 +1,75 @@
+/* C0VM trace decoder
+ *
+ * Prints the records of a trace file written by c0vm with C0_TRACE
+ * set, oldest first.  If the traced bc0 file is given as well,
+ * functions are shown by name.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "lib/c0vm.h"
+#include "lib/c0vm_insn.h"
+#include "lib/c0vm_trace.h"
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s <trace_file> [bc0_file]\n", argv[0]);
+    exit(1);
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    perror(argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  struct trace_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC) {
+    fprintf(stderr, "Error: %s is not a c0vm trace file\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  if (h.version != TRACE_VERSION
+      || h.record_size != sizeof(struct trace_record)) {
+    fprintf(stderr, "Error: trace format version %u != %u\n",
+            h.version, TRACE_VERSION);
+    exit(EXIT_FAILURE);
+  }
+
+  struct bc0_file *bc0 = argc == 3 ? read_program(argv[2]) : NULL;
+
+  printf("# %u of %" PRIu64 " instructions traced\n", h.count, h.total);
+  printf("# %14s  %-20s %6s  %-14s %6s %6s\n",
+         "seq", "function", "pc", "opcode", "stack", "calls");
+
+  uint64_t seq = h.total - h.count;
+  struct trace_record r;
+  for (uint32_t k = 0; k < h.count; k++, seq++) {
+    if (fread(&r, sizeof(r), 1, f) != 1) {
+      fprintf(stderr, "Error: trace file truncated after %u records\n", k);
+      exit(EXIT_FAILURE);
+    }
+
+    char fname[32];
+    const char *name = NULL;
+    if (bc0 != NULL && r.fn < bc0->function_count)
+      name = bc0->function_pool[r.fn].name;
+    if (name == NULL) {
+      sprintf(fname, "function_%u", (unsigned)r.fn);
+      name = fname;
+    }
+
+    char opname[8];
+    const char *op = insn_name(r.opcode);
+    if (op == NULL) {
+      sprintf(opname, "0x%02x", (unsigned)r.opcode);
+      op = opname;
+    }
+
+    printf("  %14" PRIu64 "  %-20s %6u  %-14s %6u %6u\n", seq, name,
+           (unsigned)r.pc, op, (unsigned)r.stack_depth,
+           (unsigned)r.call_depth);
+  }
+
+  fclose(f);
+  if (bc0 != NULL) free_program(bc0);
+  return 0;
+}
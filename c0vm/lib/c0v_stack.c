@@ -29,12 +29,20 @@ static inline bool is_stack_segment(list *start, list *end)
   return true;
 }
 
+static inline size_t segment_length(list *start, list *end)
+{
+  size_t i = 0;
+  for (list *p = start; p != end; p = p->next) i++;
+  return i;
+}
+
 /* Stacks */ 
 
 typedef struct c0v_stack_header stack;
 struct c0v_stack_header {
   list *top;
   list *bottom;
+  size_t size;  /* number of elements, so that size queries are O(1) */
 };
 
 bool is_c0v_stack (stack *S) {
@@ -55,6 +63,7 @@ stack *c0v_stack_new() {
   /* Dummy node: does not need to be initialized! */
   S->top = p;
   S->bottom = p;
+  S->size = 0;
 
   ENSURES(is_c0v_stack(S));
   ENSURES(c0v_stack_empty(S));
@@ -68,6 +77,7 @@ void c0v_push(stack *S, c0_value x) {
   p->data = x;
   p->next = S->top;
   S->top = p;
+  S->size++;
 
   ENSURES(is_c0v_stack(S) && !c0v_stack_empty(S));
 }
@@ -79,6 +89,7 @@ c0_value c0v_pop(stack *S) {
   c0_value x = S->top->data;    /* save old stack element to return */
   list *q = S->top;             /* save old list node to free */
   S->top = S->top->next;
+  S->size--;
   free(q);                      /* free old list node */
 
   ENSURES(is_c0v_stack(S));
@@ -88,9 +99,8 @@ c0_value c0v_pop(stack *S) {
 size_t c0v_stack_size(stack *S) {
   REQUIRES(is_c0v_stack(S));
 
-  size_t i = 0;
-  for (list *p = S->top; p != S->bottom; p = p->next) i++;
-  return i;
+  ASSERT(S->size == segment_length(S->top, S->bottom));
+  return S->size;
 }
 
 void c0v_stack_free(stack *S) {
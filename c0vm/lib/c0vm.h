@@ -42,6 +42,7 @@ struct function_info {
   uint16_t num_vars;
   uint16_t code_length;
   ubyte *code;
+  char *name;      /* from the #<name> comment before it, or NULL */
 };
 
 struct native_info {
@@ -155,7 +156,27 @@ enum instructions {
 /* function calls and returns */
   INVOKESTATIC = 0xB8,
   INVOKENATIVE = 0xB7,
-  RETURN = 0xB0
+  RETURN = 0xB0,
+
+/* internal instructions, only ever introduced by the optimizer
+ * (c0vm_optimize.c) in place of the vload heading a loop */
+  AFILL = 0xF0,
+  ACOPY = 0xF1,
+  ASEARCH = 0xF2,
+
+/* ... and in place of invokenative for these natives, keeping its
+ * operands */
+  STRLEN = 0xF3,     /* string_length */
+  STRCHARAT = 0xF4,  /* string_charat */
+  STREQ = 0xF5,      /* string_equal */
+  STRCMP = 0xF6,     /* string_compare */
+  CHARORD = 0xF7,    /* char_ord */
+  CHARCHR = 0xF8,    /* char_chr */
+  PRINTS = 0xF9,     /* print */
+  PRINTLN = 0xFA,    /* println */
+  PRINTINT = 0xFB,   /* printint */
+  PRINTCHAR = 0xFC,  /* printchar */
+  PRINTBOOL = 0xFD   /* printbool */
 };
 
 /*** The format of C0 arrays ***/
@@ -172,7 +193,18 @@ typedef struct c0_array_header c0_array;
 struct bc0_file *read_program(char *filename);
 void free_program(struct bc0_file *program);
 
-int execute(struct bc0_file *bc0);
+struct c0vm_context;
+int execute(struct c0vm_context *ctx);
+
+/* execute_quantum(ctx, quantum) runs ctx until it returns from main, or
+ * until it has taken quantum back-edges and calls (0 for no limit), or
+ * until it calls a blocking native while ctx->defer_blocking is set, or
+ * ctx->stop_native.
+ * A yielded context resumes where it stopped on the next call; a blocked
+ * one after complete_native(ctx) has run the native it is waiting on. */
+enum c0vm_status { C0VM_DONE, C0VM_YIELDED, C0VM_BLOCKED };
+enum c0vm_status execute_quantum(struct c0vm_context *ctx, size_t quantum);
+void complete_native(struct c0vm_context *ctx);
 
 
 #endif /* _C0VM_H_ */
@@ -6,27 +6,53 @@
 #include "c0vm_abort.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 
+static __thread struct c0_error_trap *trap = NULL;
+
+void c0_set_error_trap(struct c0_error_trap *t) {
+  trap = t;
+}
+
+/* Doesn't return if this thread has a trap set */
+static void spring_trap(const char *kind, char *err) {
+  if (trap == NULL) return;
+  trap->kind = kind;
+  trap->message[0] = '\0';
+  if (err != NULL) {
+    strncpy(trap->message, err, sizeof(trap->message) - 1);
+    trap->message[sizeof(trap->message) - 1] = '\0';
+  }
+  longjmp(trap->env, 1);
+}
+
 void c0_user_error(char *err) {
+  spring_trap("User error", err);
   fprintf(stderr, "User error signaled in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   exit(EXIT_FAILURE);
 }
 
 void c0_assertion_failure(char *err) {
+  spring_trap("Assertion failure", err);
+  fflush(NULL);  /* raise won't; output and logs come before the error */
   fprintf(stderr, "Assertion failure detected in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGABRT);
 }
 
 void c0_memory_error(char *err) {
+  spring_trap("Memory error", err);
+  fflush(NULL);
   fprintf(stderr, "Memory error detected in C0VM:");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGSEGV);
 }
 
 void c0_arith_error(char *err) {
+  spring_trap("Arithmetic error", err);
+  fflush(NULL);
   fprintf(stderr, "Division error detected in C0VM");
   if (err != NULL) fprintf(stderr, ": %s\n", err);
   raise(SIGFPE);
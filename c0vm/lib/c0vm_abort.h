@@ -3,7 +3,26 @@
  * Rob Simmons 
  */
 
+#include <setjmp.h>
+
+#ifndef _C0VM_ABORT_H_
+#define _C0VM_ABORT_H_
+
 void c0_user_error(char *err);        // for calls to error() in C0
 void c0_assertion_failure(char *err); // for failled assertions in C0
 void c0_memory_error(char *err);      // for memory-related errors
 void c0_arith_error(char *err);       // for arithmetic-related errors
+
+/* By default the functions above terminate the process.  A thread that
+ * runs C0 programs it must survive, like one job of a batch, can set a
+ * trap instead: errors on that thread then longjmp to trap->env with
+ * the error described in trap->kind and trap->message. */
+struct c0_error_trap {
+  jmp_buf env;
+  const char *kind;
+  char message[256];
+};
+
+void c0_set_error_trap(struct c0_error_trap *trap);  /* NULL to clear */
+
+#endif /* _C0VM_ABORT_H_ */
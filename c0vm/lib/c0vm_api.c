@@ -0,0 +1,90 @@
+/* C0VM embedding interface
+ *
+ * A call sets up the function's frame as the context's only one and
+ * runs it to completion exactly as execute runs main.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0v_stack.h"
+#include "c0vm_context.h"
+#include "c0vm_natives.h"
+#include "c0vm_optimize.h"
+#include "c0vm_api.h"
+
+/* for the args library, which embedding programs don't give arguments */
+int c0_argc;
+char **c0_argv;
+
+struct bc0_file *c0vm_load(const char *filename) {
+  REQUIRES(filename != NULL);
+
+  struct bc0_file *bc0 = read_program((char *)filename);
+  uint16_t vers = bc0->version >> 1;
+  if (BYTECODE_VERSION != vers) {
+    fprintf(stderr, "Error: %s: implementation version %u != code version %u\n",
+            filename, BYTECODE_VERSION, vers);
+    free_program(bc0);
+    return NULL;
+  }
+  optimize_program(bc0);
+  return bc0;
+}
+
+void c0vm_unload(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+  free_program(bc0);
+}
+
+int c0vm_lookup_function(struct bc0_file *bc0, const char *name) {
+  REQUIRES(bc0 != NULL && name != NULL);
+
+  for (int i = 0; i < bc0->function_count; i++) {
+    char *f = bc0->function_pool[i].name;
+    if (f != NULL && strcmp(f, name) == 0) return i;
+  }
+  return -1;
+}
+
+c0_value c0vm_call(struct c0vm_context *ctx, int fn,
+                   c0_value *args, size_t nargs) {
+  REQUIRES(ctx != NULL);
+  REQUIRES(0 <= fn && fn < ctx->bc0->function_count);
+  REQUIRES(nargs == ctx->bc0->function_pool[fn].num_args);
+  REQUIRES(nargs == 0 || args != NULL);
+  REQUIRES(!ctx->started || ctx->done);
+  REQUIRES(stack_empty(ctx->call_stack));
+
+  /* Replace the frame c0vm_context_new made for main, if it's there */
+  struct function_info *f = &ctx->bc0->function_pool[fn];
+  if (ctx->S != NULL) c0v_stack_free(ctx->S);
+  free(ctx->V);
+  ctx->S = c0v_stack_new();
+  ctx->V = xcalloc(f->num_vars, sizeof(c0_value));
+  for (size_t i = 0; i < nargs; i++) ctx->V[i] = args[i];
+  ctx->fn = fn;
+  ctx->P = f->code;
+  ctx->pc = 0;
+  ctx->started = false;
+  ctx->done = false;
+
+  enum c0vm_status status;
+  while ((status = execute_quantum(ctx, 0)) != C0VM_DONE)
+    if (status == C0VM_BLOCKED) complete_native(ctx);
+  return ctx->result;
+}
+
+bool c0vm_register_native(struct c0vm_context *ctx, const char *name,
+                          c0vm_native_fn *fn) {
+  REQUIRES(ctx != NULL && name != NULL && fn != NULL);
+
+  int idx = native_lookup(name);
+  if (idx < 0) return false;
+  ctx->natives[idx] = fn;
+  ctx->intrinsics = false;  /* they would bypass fn */
+  return true;
+}
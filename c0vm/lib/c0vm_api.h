@@ -0,0 +1,49 @@
+/* C0VM embedding interface
+ *
+ * For C and C++ programs that keep a C0 program loaded and call into it:
+ *
+ *   struct bc0_file *bc0 = c0vm_load("tool.bc0");
+ *   struct c0vm_context *ctx = c0vm_context_new(bc0, 0, NULL);
+ *   int f = c0vm_lookup_function(bc0, "score");
+ *   c0_value args[2] = { int2val(3), ptr2val(NULL) };
+ *   int s = val2int(c0vm_call(ctx, f, args, 2));
+ *
+ * Link with libc0vm.a, -rdynamic, -ldl and -pthread, with the C0
+ * libraries' directories in the rpath (see lib/c0vm_dlnative.h).  A
+ * native whose library can't be loaded is a C0 error when called.  C0
+ * errors end the process unless the calling thread has set a trap with
+ * c0_set_error_trap (c0vm_abort.h); after a trapped error, use a new
+ * context.  Memory the program allocates belongs to the context and
+ * lives until c0vm_context_free.
+ */
+
+#include <stddef.h>
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_context.h"
+
+#ifndef _C0VM_API_H_
+#define _C0VM_API_H_
+
+/* Read and prepare a bc0 file; NULL if it is for another VM version */
+struct bc0_file *c0vm_load(const char *filename);
+void c0vm_unload(struct bc0_file *bc0);
+
+/* Index of the function named name, or -1.  Names come from the
+ * comments cc0 writes before each function. */
+int c0vm_lookup_function(struct bc0_file *bc0, const char *name);
+
+/* Call function fn with nargs == its number of arguments and return its
+ * result.  ctx must not be in the middle of another call or of
+ * execute; calls on one context run one after another, sharing its
+ * heap. */
+c0_value c0vm_call(struct c0vm_context *ctx, int fn,
+                   c0_value *args, size_t nargs);
+
+/* Have calls to the library native called name (like "print" or
+ * "string_join") in ctx go to fn instead.  Returns false if no native
+ * has that name. */
+bool c0vm_register_native(struct c0vm_context *ctx, const char *name,
+                          c0vm_native_fn *fn);
+
+#endif /* _C0VM_API_H_ */
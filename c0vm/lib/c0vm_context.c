@@ -0,0 +1,84 @@
+/* C0VM execution context
+ *
+ * The C0 heap is a list of allocations, each preceded by a header
+ * linking it to the previous one; C0 has no free, so they are all
+ * released together with the context.
+ */
+
+#include <stdlib.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "stack.h"
+#include "c0v_stack.h"
+#include "c0vm_context.h"
+#include "c0vm_natives.h"
+#include "c0vm_profile.h"
+
+struct c0vm_context *c0vm_context_new(struct bc0_file *bc0,
+                                      int argc, char **argv) {
+  REQUIRES(bc0 != NULL);
+
+  struct c0vm_context *ctx = xcalloc(1, sizeof(struct c0vm_context));
+  ctx->bc0 = bc0;
+  ctx->argc = argc;
+  ctx->argv = argv;
+  ctx->in = stdin;
+  ctx->out = stdout;
+  natives_install(ctx);
+  ctx->intrinsics = true;
+
+  ctx->S = c0v_stack_new();
+  ctx->fn = 0;
+  ctx->P = bc0->function_pool[0].code;
+  ctx->pc = 0;
+  ctx->V = xcalloc(bc0->function_pool[0].num_vars, sizeof(c0_value));
+  ctx->call_stack = stack_new();
+  ctx->stop_native = -1;
+  return ctx;
+}
+
+static void frame_free(stack_elem x) {
+  struct c0vm_frame *f = x;
+  c0v_stack_free(f->S);
+  free(f->V);
+  free(f);
+}
+
+void c0vm_context_free(struct c0vm_context *ctx) {
+  REQUIRES(ctx != NULL);
+
+  /* left over if the program didn't finish */
+  if (ctx->S != NULL) c0v_stack_free(ctx->S);
+  free(ctx->V);
+  stack_free(ctx->call_stack, frame_free);
+  free(ctx->pending_args);
+  free(ctx->native_args);
+
+  struct c0_allocation *a = ctx->heap;
+  while (a != NULL) {
+    struct c0_allocation *next = a->next;
+    free(a);
+    a = next;
+  }
+
+  struct c0vm_option *o = ctx->options;
+  while (o != NULL) {
+    struct c0vm_option *next = o->next;
+    free(o);
+    o = next;
+  }
+
+  free(ctx);
+}
+
+void *c0vm_alloc(struct c0vm_context *ctx, size_t size) {
+  REQUIRES(ctx != NULL);
+
+  if (c0_profiling) profile_alloc(size);
+  struct c0_allocation *a = xcalloc(1, sizeof(struct c0_allocation) + size);
+  a->next = ctx->heap;
+  a->size = size;
+  ctx->heap = a;
+  return a + 1;
+}
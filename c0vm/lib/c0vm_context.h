@@ -0,0 +1,99 @@
+/* C0VM execution context
+ *
+ * Everything one running C0 program owns: its arguments, its heap, its
+ * standard input and output, and the natives that need any of these.
+ * The loaded program itself is only read, so one bc0_file can be
+ * shared by contexts running concurrently on different threads.
+ */
+
+#include <stdio.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "stack.h"
+#include "c0v_stack.h"
+
+#ifndef _C0VM_CONTEXT_H_
+#define _C0VM_CONTEXT_H_
+
+struct c0vm_context;
+
+/* Natives implemented by the VM, which get the context as well */
+typedef c0_value c0vm_native_fn(struct c0vm_context *ctx, c0_value *args);
+
+/* A registered command line option (args library) */
+struct c0vm_option {
+  enum { OPTION_FLAG, OPTION_INT, OPTION_STRING } kind;
+  char *name;
+  void *ptr;  /* C0 bool*, int* or string* to store the value in */
+  struct c0vm_option *next;
+};
+
+/* A suspended caller on the call stack */
+struct c0vm_frame {
+  c0v_stack_t S;  /* Operand stack of C0 values */
+  size_t fn;      /* Function index in the function pool */
+  ubyte *P;       /* Function body */
+  size_t pc;      /* Program counter */
+  c0_value *V;    /* The local variables */
+};
+
+/* Header of each C0 heap block, which follows it */
+struct c0_allocation {
+  struct c0_allocation *next;
+  size_t size;  /* also pads the header to 16 bytes, keeping alignment */
+};
+
+struct c0vm_context {
+  struct bc0_file *bc0;   /* shared, never written */
+
+  /* for the args library -- argv[0] is the bc0 file */
+  int argc;
+  char **argv;
+  struct c0vm_option *options;
+
+  FILE *in;               /* for the conio library, stdin by default */
+  FILE *out;              /* stdout by default */
+
+  struct c0_allocation *heap;  /* every allocation, newest first */
+
+  /* INVOKENATIVE calls natives[i] if it is set and the library's native
+   * (native_function(i)) otherwise */
+  c0vm_native_fn *natives[NATIVE_FUNCTION_COUNT];
+  bool intrinsics;        /* false once a host replaces any native */
+
+  /* The running function, kept here so execution can stop and resume.
+   * S, V and call_stack are always current; fn, P and pc only while
+   * execute_quantum isn't running. */
+  bool started;
+  bool done;
+  c0_value result;        /* once done */
+  c0v_stack_t S;
+  size_t fn;
+  ubyte *P;
+  size_t pc;
+  c0_value *V;
+  gstack_t call_stack;    /* of struct c0vm_frame* */
+
+  /* If set, execute_quantum returns C0VM_BLOCKED instead of calling a
+   * native that may block; the native's index and arguments wait here */
+  bool defer_blocking;
+  uint16_t pending_native;
+  c0_value *pending_args;
+
+  /* The arguments of the native INVOKENATIVE is calling, freed with the
+   * context if the native raises an error instead of returning */
+  c0_value *native_args;
+
+  /* A native to stop before as if it blocked (even with defer_blocking
+   * unset), or -1; for taking snapshots */
+  int32_t stop_native;
+};
+
+struct c0vm_context *c0vm_context_new(struct bc0_file *bc0,
+                                      int argc, char **argv);
+void c0vm_context_free(struct c0vm_context *ctx);
+
+/* c0vm_alloc(ctx, size) returns zeroed memory that lives as long as ctx */
+void *c0vm_alloc(struct c0vm_context *ctx, size_t size);
+
+#endif /* _C0VM_CONTEXT_H_ */
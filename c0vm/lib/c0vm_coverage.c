@@ -0,0 +1,265 @@
+/* C0VM branch and block coverage
+ *
+ * Basic blocks start at pc 0, at branch targets and after branches,
+ * returns and throws.  A branch's outcome is seen at the next
+ * instruction: it fell through iff that is at pc+3.  Counts are kept
+ * for the original orientation of each branch, even if the optimizer
+ * has negated it, so that profiles stay comparable across runs.
+ *
+ * Profile file format (text):
+ *   c0vm-coverage 1 <hash>
+ *   f <function index> <code length>
+ *   b <pc> <executions>            one per executed block
+ *   j <pc> <taken> <not taken>     one per executed branch
+ *
+ * A run counts from zero and adds its counts to the file's when it
+ * exits, under a lock, so runs that overlap -- forked server children,
+ * or c0vm processes started side by side -- don't lose each other's.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_insn.h"
+#include "c0vm_coverage.h"
+
+#define COVERAGE_VERSION 1
+
+bool c0_coverage = false;
+
+struct fn_coverage {
+  size_t length;
+  bool *leader;        /* per pc: does a basic block start here? */
+  bool *inverted;      /* per pc: has the branch here been negated? */
+  uint64_t *blocks;    /* per pc: executions of the block starting here */
+  uint64_t *taken;     /* per pc: outcomes of the branch here */
+  uint64_t *not_taken;
+};
+
+static char *profile_file;
+static uint64_t hash;
+static bool loaded;    /* counts from earlier runs were read */
+static size_t function_count;
+static struct fn_coverage *fns;      /* this run's counts */
+static struct fn_coverage *earlier;  /* earlier runs', for the optimizer */
+
+static bool pending;   /* the previous instruction was a conditional */
+static size_t pending_fn;
+static size_t pending_pc;
+
+static inline bool is_conditional(ubyte op) {
+  return IF_CMPEQ <= op && op <= IF_ICMPLE;
+}
+
+void coverage_insn(size_t fn, size_t pc, ubyte opcode) {
+  bool count_block = true;
+  if (pending) {
+    struct fn_coverage *c = &fns[pending_fn];
+    bool taken = pc != pending_pc + 3;
+    if (c->inverted[pending_pc]) {
+      /* The goto after a negated branch runs exactly when the original
+       * goto didn't; count blocks as the original code would have. */
+      taken = !taken;
+      if (taken) count_block = false;
+      else c->blocks[pending_pc + 3]++;
+    }
+    if (taken) c->taken[pending_pc]++;
+    else c->not_taken[pending_pc]++;
+    pending = false;
+  }
+
+  struct fn_coverage *c = &fns[fn];
+  if (c->leader[pc] && count_block) c->blocks[pc]++;
+  if (is_conditional(opcode)) {
+    pending = true;
+    pending_fn = fn;
+    pending_pc = pc;
+  }
+}
+
+bool coverage_branch(size_t fn, size_t pc, uint64_t *taken,
+                     uint64_t *not_taken) {
+  REQUIRES(fn < function_count && pc < fns[fn].length);
+  if (!loaded) return false;
+  *taken = earlier[fn].taken[pc];
+  *not_taken = earlier[fn].not_taken[pc];
+  return *taken + *not_taken > 0;
+}
+
+void coverage_inverted(size_t fn, size_t pc) {
+  REQUIRES(fn < function_count && pc < fns[fn].length);
+  fns[fn].inverted[pc] = true;
+}
+
+/* FNV-1a over everything read from the bc0 file */
+static uint64_t fnv(uint64_t h, const void *p, size_t len) {
+  const ubyte *b = p;
+  for (size_t k = 0; k < len; k++) h = (h ^ b[k]) * 1099511628211u;
+  return h;
+}
+
+uint64_t program_hash(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  uint64_t h = 14695981039346656037u;
+  h = fnv(h, &bc0->version, sizeof(bc0->version));
+  h = fnv(h, bc0->int_pool, bc0->int_count * sizeof(int32_t));
+  h = fnv(h, bc0->string_pool, bc0->string_count);
+  for (size_t j = 0; j < bc0->function_count; j++) {
+    struct function_info *f = &bc0->function_pool[j];
+    h = fnv(h, &f->num_args, sizeof(f->num_args));
+    h = fnv(h, &f->num_vars, sizeof(f->num_vars));
+    h = fnv(h, &f->code_length, sizeof(f->code_length));
+    h = fnv(h, f->code, f->code_length);
+  }
+  for (size_t j = 0; j < bc0->native_count; j++) {
+    struct native_info *n = &bc0->native_pool[j];
+    h = fnv(h, &n->num_args, sizeof(n->num_args));
+    h = fnv(h, &n->function_table_index, sizeof(n->function_table_index));
+  }
+  return h;
+}
+
+static void find_leaders(struct function_info *f, bool *leader) {
+  ubyte *P = f->code;
+  size_t pc = 0;
+  leader[0] = f->code_length > 0;
+  while (pc < f->code_length) {
+    size_t len = insn_length(P[pc]);
+    if (len == 0 || pc + len > f->code_length) break;
+    ubyte op = P[pc];
+    if (op == GOTO || is_conditional(op)) {
+      size_t t = pc + (int16_t)(P[pc+1]<<8 | P[pc+2]);
+      if (t < f->code_length) leader[t] = true;
+    }
+    if ((op == GOTO || is_conditional(op) || op == RETURN || op == ATHROW)
+        && pc + len < f->code_length)
+      leader[pc + len] = true;
+    pc += len;
+  }
+}
+
+/* Add the counts in F to into; false if F is for a different program or
+ * format, which is then started afresh */
+static bool read_counts(FILE *F, struct fn_coverage *into) {
+  unsigned version;
+  uint64_t h;
+  if (fscanf(F, "c0vm-coverage %u %" SCNx64, &version, &h) != 2
+      || version != COVERAGE_VERSION || h != hash)
+    return false;
+
+  struct fn_coverage *c = NULL;
+  char kind;
+  while (fscanf(F, " %c", &kind) == 1) {
+    size_t a, b;
+    uint64_t x, y;
+    if (kind == 'f' && fscanf(F, "%zu %zu", &a, &b) == 2) {
+      c = a < function_count && into[a].length == b ? &into[a] : NULL;
+    } else if (kind == 'b' && fscanf(F, "%zu %" SCNu64, &a, &x) == 2) {
+      if (c != NULL && a < c->length) c->blocks[a] += x;
+    } else if (kind == 'j'
+               && fscanf(F, "%zu %" SCNu64 " %" SCNu64, &a, &x, &y) == 3) {
+      if (c != NULL && a < c->length) {
+        c->taken[a] += x;
+        c->not_taken[a] += y;
+      }
+    } else {
+      fprintf(stderr, "Warning: ignoring malformed $C0_COVERAGE file\n");
+      break;
+    }
+  }
+  return true;
+}
+
+static void alloc_counts(struct fn_coverage *c, size_t length) {
+  c->length = length;
+  c->blocks = xcalloc(length + 1, sizeof(uint64_t));
+  c->taken = xcalloc(length + 1, sizeof(uint64_t));
+  c->not_taken = xcalloc(length + 1, sizeof(uint64_t));
+}
+
+static void free_counts(struct fn_coverage *c) {
+  for (size_t fn = 0; fn < function_count; fn++) {
+    free(c[fn].leader);
+    free(c[fn].inverted);
+    free(c[fn].blocks);
+    free(c[fn].taken);
+    free(c[fn].not_taken);
+  }
+  free(c);
+}
+
+static void coverage_write(void) {
+  int fd = open(profile_file, O_RDWR | O_CREAT, 0666);
+  struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+  if (fd < 0 || fcntl(fd, F_SETLKW, &lock) != 0) {
+    perror("Couldn't write $C0_COVERAGE");
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  /* Add in what the file has now, which includes any runs that ended
+   * since this one started, and write the sum back */
+  FILE *F = fdopen(fd, "r+");
+  if (F == NULL) {
+    perror("Couldn't write $C0_COVERAGE");
+    close(fd);
+    return;
+  }
+  read_counts(F, fns);
+  rewind(F);
+  if (ftruncate(fd, 0) != 0) {
+    perror("Couldn't write $C0_COVERAGE");
+    fclose(F);
+    return;
+  }
+  fprintf(F, "c0vm-coverage %d %016" PRIx64 "\n", COVERAGE_VERSION, hash);
+  for (size_t fn = 0; fn < function_count; fn++) {
+    struct fn_coverage *c = &fns[fn];
+    fprintf(F, "f %zu %zu\n", fn, c->length);
+    for (size_t pc = 0; pc < c->length; pc++) {
+      if (c->blocks[pc] > 0)
+        fprintf(F, "b %zu %" PRIu64 "\n", pc, c->blocks[pc]);
+      if (c->taken[pc] + c->not_taken[pc] > 0)
+        fprintf(F, "j %zu %" PRIu64 " %" PRIu64 "\n",
+                pc, c->taken[pc], c->not_taken[pc]);
+    }
+  }
+  if (fclose(F) != 0) perror("Couldn't write $C0_COVERAGE");
+
+  free_counts(fns);
+  free_counts(earlier);
+}
+
+void coverage_init(struct bc0_file *bc0, char *filename) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+
+  profile_file = filename;
+  hash = program_hash(bc0);
+  function_count = bc0->function_count;
+  fns = xcalloc(function_count, sizeof(struct fn_coverage));
+  earlier = xcalloc(function_count, sizeof(struct fn_coverage));
+  for (size_t fn = 0; fn < function_count; fn++) {
+    struct function_info *f = &bc0->function_pool[fn];
+    struct fn_coverage *c = &fns[fn];
+    alloc_counts(c, f->code_length);
+    c->leader = xcalloc(c->length + 1, sizeof(bool));
+    c->inverted = xcalloc(c->length + 1, sizeof(bool));
+    find_leaders(f, c->leader);
+    alloc_counts(&earlier[fn], f->code_length);
+  }
+
+  FILE *F = fopen(filename, "r");
+  if (F != NULL) {
+    loaded = read_counts(F, earlier);
+    fclose(F);
+  }
+  c0_coverage = true;
+  atexit(coverage_write);
+}
@@ -0,0 +1,33 @@
+/* C0VM branch and block coverage
+ *
+ * Counts executions of every basic block and taken/not-taken outcomes
+ * of every conditional branch, and keeps them in a profile file keyed
+ * by a hash of the bytecode.  Enabled by setting C0_COVERAGE to the
+ * profile file: counts in it from earlier runs of the same program are
+ * loaded, handed to the optimizer, and accumulated into.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_COVERAGE_H_
+#define _C0VM_COVERAGE_H_
+
+extern bool c0_coverage;  /* true once coverage_init has been called */
+
+/* Must be called before the program is optimized */
+void coverage_init(struct bc0_file *bc0, char *filename);
+
+void coverage_insn(size_t fn, size_t pc, ubyte opcode);
+
+/* Counts so far for the branch at function_pool[fn].code[pc], which
+ * before execute starts are those of earlier runs; false if none */
+bool coverage_branch(size_t fn, size_t pc, uint64_t *taken,
+                     uint64_t *not_taken);
+
+/* The optimizer negated the branch at function_pool[fn].code[pc] */
+void coverage_inverted(size_t fn, size_t pc);
+
+uint64_t program_hash(struct bc0_file *bc0);
+
+#endif /* _C0VM_COVERAGE_H_ */
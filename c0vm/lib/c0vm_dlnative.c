@@ -0,0 +1,125 @@
+/* C0VM native libraries, loaded on demand
+ *
+ * Libraries are found like any other shared library, so the rpath the
+ * Makefile gives the VM applies.  The runtime (libbare) is opened first
+ * and RTLD_GLOBAL, since the libraries use it; the VM is linked with
+ * -rdynamic so that they also see c0_argc and c0_argv.
+ *
+ * A native that can't be found is a C0 error when it is called, so a
+ * trap set by c0vm-batch or a host catches it for just that program.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "contracts.h"
+#include "c0vm_abort.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_natives.h"
+#include "c0vm_dlnative.h"
+
+#define RUNTIME "libbare.so"
+
+/* Filled in by native_resolve; this replaces the c0vm_c0ffi.c that
+ * wrappergen also generates, which is not kept, as its table would link
+ * every library */
+native_fn *native_function_table[NATIVE_FUNCTION_COUNT];
+
+/* Each library's natives are consecutive in the table */
+static struct library {
+  uint16_t first;
+  const char *file;
+  void *handle;
+} libraries[] = {
+  { NATIVE_FADD, "lib15411.so", NULL },
+  { NATIVE_ARGS_FLAG, "libargs.so", NULL },
+  { NATIVE_EOF, "libconio.so", NULL },
+  { NATIVE_C_ADDCH, "libcurses.so", NULL },
+  { NATIVE_FILE_CLOSE, "libfile.so", NULL },
+  { NATIVE_IMAGE_CLONE, "libimg.so", NULL },
+  { NATIVE_INT_TOKENS, "libparse.so", NULL },
+  { NATIVE_CHAR_CHR, "libstring.so", NULL },
+};
+#define LIBRARY_COUNT (sizeof(libraries) / sizeof(libraries[0]))
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static void *runtime = NULL;
+
+static struct library *library_of(uint16_t idx) {
+  size_t i = LIBRARY_COUNT - 1;
+  while (libraries[i].first > idx) i--;
+  return &libraries[i];
+}
+
+/* Called with lock held; false, saying why in err, if it can't be opened */
+static bool open_library(void **handle, const char *file, int flags,
+                         char *err, size_t len) {
+  if (*handle != NULL) return true;
+  *handle = dlopen(file, RTLD_NOW | flags);
+  if (*handle == NULL) {
+    snprintf(err, len, "can't load C0 library: %s", dlerror());
+    return false;
+  }
+  return true;
+}
+
+static bool resolve(uint16_t idx, char *err, size_t len) {
+  if (idx >= NATIVE_FUNCTION_COUNT) {
+    snprintf(err, len, "no native %u", (unsigned)idx);
+    return false;
+  }
+
+  pthread_mutex_lock(&lock);
+  bool ok = true;
+  if (native_function_table[idx] == NULL) {
+    struct library *lib = library_of(idx);
+    ok = open_library(&runtime, RUNTIME, RTLD_GLOBAL, err, len)
+      && open_library(&lib->handle, lib->file, RTLD_LOCAL, err, len);
+
+    char symbol[64];
+    snprintf(symbol, sizeof(symbol), "__c0ffi_%s", native_names[idx]);
+    void *sym = ok ? dlsym(lib->handle, symbol) : NULL;
+    if (ok && sym == NULL) {
+      snprintf(err, len, "%s has no native %s", lib->file, symbol);
+      ok = false;
+    }
+    if (ok) {
+      /* POSIX guarantees data and function pointers convert for dlsym */
+      native_fn *f;
+      memcpy(&f, &sym, sizeof(f));
+      __atomic_store_n(&native_function_table[idx], f, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return ok;
+}
+
+native_fn *native_resolve(uint16_t idx) {
+  char err[256];
+  if (!resolve(idx, err, sizeof(err))) c0_user_error(err);
+  return native_function_table[idx];
+}
+
+bool natives_load(struct bc0_file *bc0, char *err, size_t len) {
+  REQUIRES(bc0 != NULL && err != NULL);
+
+  for (size_t j = 0; j < bc0->native_count; j++) {
+    uint16_t idx = bc0->native_pool[j].function_table_index;
+    if (!native_builtin(idx) && !resolve(idx, err, len)) return false;
+  }
+  return true;
+}
+
+void natives_preload(void) {
+  char err[256];
+  for (uint16_t idx = 0; idx < NATIVE_FUNCTION_COUNT; idx++) {
+    if (!resolve(idx, err, sizeof(err))) {
+      fprintf(stderr, "Error: %s\n", err);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
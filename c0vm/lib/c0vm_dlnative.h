@@ -0,0 +1,36 @@
+/* C0VM native libraries, loaded on demand
+ *
+ * The C0 libraries aren't linked into the VM.  native_function_table
+ * starts out empty and each entry is looked up with dlsym the first
+ * time it is called, or when a program calling it is loaded, dlopening
+ * its library (and the C0 runtime) if no earlier native needed it.
+ * Programs that only use the natives the VM implements itself load no
+ * libraries at all.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+
+#ifndef _C0VM_DLNATIVE_H_
+#define _C0VM_DLNATIVE_H_
+
+/* Look up native_function_table[idx]; a C0 error if it can't be loaded */
+native_fn *native_resolve(uint16_t idx);
+
+static inline native_fn *native_function(uint16_t idx) {
+  native_fn *f = __atomic_load_n(&native_function_table[idx],
+                                 __ATOMIC_ACQUIRE);
+  return f != NULL ? f : native_resolve(idx);
+}
+
+/* Load and look up the library natives bc0 calls now, so that a missing
+ * one is found before the program runs; false, saying why in err, if
+ * one can't be */
+bool natives_load(struct bc0_file *bc0, char *err, size_t len);
+
+/* Load and look up every native now, for processes that fork to run
+ * programs; exits if any can't be */
+void natives_preload(void);
+
+#endif /* _C0VM_DLNATIVE_H_ */
@@ -0,0 +1,138 @@
+/* C0VM allocation-site heap profiler
+ *
+ * Sites are kept in a table per function indexed by pc, so counting an
+ * allocation is two increments.  The report is written at exit, as
+ * the profiler's is.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_insn.h"
+#include "c0vm_profile.h"
+#include "c0vm_heapprof.h"
+
+bool c0_heap_profiling = false;
+
+struct site {
+  uint64_t count;
+  uint64_t bytes;
+};
+
+/* A site, for sorting */
+struct ranked {
+  size_t fn;
+  size_t pc;
+  struct site s;
+};
+
+static FILE *report;
+static size_t function_count;
+static char **names;
+static size_t *code_length;
+static ubyte **opcodes;      /* the allocating opcode at each site */
+static struct site **sites;  /* sites[fn][pc] */
+
+void heapprof_alloc(size_t fn, size_t pc, size_t bytes) {
+  REQUIRES(fn < function_count && pc < code_length[fn]);
+
+  sites[fn][pc].count++;
+  sites[fn][pc].bytes += bytes;
+}
+
+static int by_bytes_desc(const void *a, const void *b) {
+  const struct ranked *x = a, *y = b;
+  if (x->s.bytes != y->s.bytes) return x->s.bytes < y->s.bytes ? 1 : -1;
+  return x->s.count < y->s.count ? 1 : x->s.count > y->s.count ? -1 : 0;
+}
+
+static void heapprof_report(void) {
+  size_t nsites = 0;
+  struct site total = { 0, 0 };
+  for (size_t fn = 0; fn < function_count; fn++)
+    for (size_t pc = 0; pc < code_length[fn]; pc++)
+      if (sites[fn][pc].count > 0) nsites++;
+
+  struct ranked *ranked = xcalloc(nsites + 1, sizeof(struct ranked));
+  struct ranked *by_fn = xcalloc(function_count + 1, sizeof(struct ranked));
+  size_t k = 0;
+  for (size_t fn = 0; fn < function_count; fn++) {
+    by_fn[fn].fn = fn;
+    for (size_t pc = 0; pc < code_length[fn]; pc++) {
+      struct site *s = &sites[fn][pc];
+      if (s->count == 0) continue;
+      ranked[k].fn = fn;
+      ranked[k].pc = pc;
+      ranked[k].s = *s;
+      k++;
+      by_fn[fn].s.count += s->count;
+      by_fn[fn].s.bytes += s->bytes;
+      total.count += s->count;
+      total.bytes += s->bytes;
+    }
+  }
+  qsort(ranked, nsites, sizeof(struct ranked), by_bytes_desc);
+  qsort(by_fn, function_count, sizeof(struct ranked), by_bytes_desc);
+
+  fprintf(report, "# c0vm heap profile: %" PRIu64 " allocations, %" PRIu64
+          " bytes, all live\n\n", total.count, total.bytes);
+
+  fprintf(report, "# sites, by bytes\n%16s %7s %12s %10s  %s\n",
+          "bytes", "%", "allocations", "avg bytes", "site");
+  for (k = 0; k < nsites; k++) {
+    struct ranked *r = &ranked[k];
+    const char *op = insn_name(opcodes[r->fn][r->pc]);
+    fprintf(report, "%16" PRIu64 " %6.2f%% %12" PRIu64 " %10" PRIu64
+            "  %s+%zu (%s)\n", r->s.bytes,
+            profile_percent(r->s.bytes, total.bytes), r->s.count,
+            r->s.bytes / r->s.count, profile_fn_name(names, r->fn), r->pc,
+            op == NULL ? "?" : op);
+  }
+
+  fprintf(report, "\n# functions, by bytes\n%16s %7s %12s  %s\n",
+          "bytes", "%", "allocations", "function");
+  for (k = 0; k < function_count && by_fn[k].s.count > 0; k++)
+    fprintf(report, "%16" PRIu64 " %6.2f%% %12" PRIu64 "  %s\n",
+            by_fn[k].s.bytes, profile_percent(by_fn[k].s.bytes, total.bytes),
+            by_fn[k].s.count, profile_fn_name(names, by_fn[k].fn));
+
+  fclose(report);
+  free(ranked);
+  free(by_fn);
+  for (size_t fn = 0; fn < function_count; fn++) {
+    free(opcodes[fn]);
+    free(sites[fn]);
+  }
+  profile_free_names(names, function_count);
+  free(opcodes);
+  free(sites);
+  free(code_length);
+}
+
+void heapprof_init(struct bc0_file *bc0, char *filename) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+
+  report = fopen(filename, "w");
+  if (report == NULL) {
+    perror("Couldn't open $C0_HEAP_PROFILE");
+    exit(EXIT_FAILURE);
+  }
+  function_count = bc0->function_count;
+  names = profile_copy_names(bc0);
+  code_length = xcalloc(function_count, sizeof(size_t));
+  opcodes = xcalloc(function_count, sizeof(ubyte *));
+  sites = xcalloc(function_count, sizeof(struct site *));
+  for (size_t fn = 0; fn < function_count; fn++) {
+    struct function_info *f = &bc0->function_pool[fn];
+    code_length[fn] = f->code_length;
+    opcodes[fn] = xcalloc(f->code_length + 1, sizeof(ubyte));
+    memcpy(opcodes[fn], f->code, f->code_length);
+    sites[fn] = xcalloc(f->code_length + 1, sizeof(struct site));
+  }
+  c0_heap_profiling = true;
+  atexit(heapprof_report);
+}
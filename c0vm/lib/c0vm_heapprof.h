@@ -0,0 +1,23 @@
+/* C0VM allocation-site heap profiler
+ *
+ * Counts the allocations and bytes each NEW and NEWARRAY instruction
+ * makes, and reports the sites and functions responsible for the most
+ * memory.  Enabled by setting C0_HEAP_PROFILE to the file the report is
+ * written to when the program exits.  C0 memory is never freed while
+ * the program runs, so everything allocated is also live.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_HEAPPROF_H_
+#define _C0VM_HEAPPROF_H_
+
+extern bool c0_heap_profiling;  /* true once heapprof_init has been called */
+
+void heapprof_init(struct bc0_file *bc0, char *filename);
+
+/* The instruction at function_pool[fn].code[pc] allocated bytes */
+void heapprof_alloc(size_t fn, size_t pc, size_t bytes);
+
+#endif /* _C0VM_HEAPPROF_H_ */
@@ -0,0 +1,97 @@
+/* C0VM instruction table
+ * Lengths and mnemonics of the instructions in enum instructions
+ */
+
+#include <stddef.h>
+#include "c0vm.h"
+#include "c0vm_insn.h"
+
+size_t insn_length(ubyte op) {
+  switch (op) {
+  case IADD: case IAND: case IDIV: case IMUL: case IOR: case IREM:
+  case ISHL: case ISHR: case ISUB: case IXOR:
+  case DUP: case POP: case SWAP:
+  case ARRAYLENGTH: case AADDS:
+  case IMLOAD: case AMLOAD: case IMSTORE: case AMSTORE:
+  case CMLOAD: case CMSTORE:
+  case ACONST_NULL: case NOP: case ATHROW: case ASSERT: case RETURN:
+    return 1;
+  case NEWARRAY: case NEW: case AADDF:
+  case VLOAD: case VSTORE: case BIPUSH:
+  case AFILL: case ACOPY: case ASEARCH:
+    return 2;
+  case ILDC: case ALDC:
+  case IF_CMPEQ: case IF_CMPNE: case IF_ICMPLT: case IF_ICMPGE:
+  case IF_ICMPGT: case IF_ICMPLE: case GOTO:
+  case INVOKESTATIC: case INVOKENATIVE:
+  case STRLEN: case STRCHARAT: case STREQ: case STRCMP:
+  case CHARORD: case CHARCHR:
+  case PRINTS: case PRINTLN: case PRINTINT: case PRINTCHAR: case PRINTBOOL:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+const char *insn_name(ubyte op) {
+  switch (op) {
+  case IADD: return "iadd";
+  case IAND: return "iand";
+  case IDIV: return "idiv";
+  case IMUL: return "imul";
+  case IOR: return "ior";
+  case IREM: return "irem";
+  case ISHL: return "ishl";
+  case ISHR: return "ishr";
+  case ISUB: return "isub";
+  case IXOR: return "ixor";
+  case DUP: return "dup";
+  case POP: return "pop";
+  case SWAP: return "swap";
+  case NEWARRAY: return "newarray";
+  case ARRAYLENGTH: return "arraylength";
+  case NEW: return "new";
+  case AADDF: return "aaddf";
+  case AADDS: return "aadds";
+  case IMLOAD: return "imload";
+  case AMLOAD: return "amload";
+  case IMSTORE: return "imstore";
+  case AMSTORE: return "amstore";
+  case CMLOAD: return "cmload";
+  case CMSTORE: return "cmstore";
+  case VLOAD: return "vload";
+  case VSTORE: return "vstore";
+  case ACONST_NULL: return "aconst_null";
+  case BIPUSH: return "bipush";
+  case ILDC: return "ildc";
+  case ALDC: return "aldc";
+  case NOP: return "nop";
+  case IF_CMPEQ: return "if_cmpeq";
+  case IF_CMPNE: return "if_cmpne";
+  case IF_ICMPLT: return "if_icmplt";
+  case IF_ICMPGE: return "if_icmpge";
+  case IF_ICMPGT: return "if_icmpgt";
+  case IF_ICMPLE: return "if_icmple";
+  case GOTO: return "goto";
+  case ATHROW: return "athrow";
+  case ASSERT: return "assert";
+  case INVOKESTATIC: return "invokestatic";
+  case INVOKENATIVE: return "invokenative";
+  case RETURN: return "return";
+  case AFILL: return "afill";
+  case ACOPY: return "acopy";
+  case ASEARCH: return "asearch";
+  case STRLEN: return "strlen";
+  case STRCHARAT: return "strcharat";
+  case STREQ: return "streq";
+  case STRCMP: return "strcmp";
+  case CHARORD: return "charord";
+  case CHARCHR: return "charchr";
+  case PRINTS: return "prints";
+  case PRINTLN: return "println";
+  case PRINTINT: return "printint";
+  case PRINTCHAR: return "printchar";
+  case PRINTBOOL: return "printbool";
+  default: return NULL;
+  }
+}
@@ -0,0 +1,16 @@
+/* C0VM instruction table
+ * Lengths and mnemonics of the instructions in enum instructions
+ */
+
+#include "c0vm.h"
+
+#ifndef _C0VM_INSN_H_
+#define _C0VM_INSN_H_
+
+/* Length in bytes of the instruction with opcode op, 0 if unknown */
+size_t insn_length(ubyte op);
+
+/* Mnemonic of opcode op as in c0vm-ref.txt, NULL if unknown */
+const char *insn_name(ubyte op);
+
+#endif /* _C0VM_INSN_H_ */
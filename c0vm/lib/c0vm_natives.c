@@ -0,0 +1,323 @@
+/* C0VM natives implemented by the VM
+ *
+ * C0 strings are NUL-terminated char*, where NULL is the empty string.
+ * Strings and arrays returned to C0 are allocated on the context's heap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_context.h"
+#include "c0vm_natives.h"
+
+static inline char *val2str(c0_value v) {
+  char *s = val2ptr(v);
+  return s == NULL ? "" : s;
+}
+
+/*** conio ***/
+
+static c0_value vm_print(struct c0vm_context *ctx, c0_value *args) {
+  fputs(val2str(args[0]), ctx->out);
+  return int2val(0);
+}
+
+static c0_value vm_println(struct c0vm_context *ctx, c0_value *args) {
+  fputs(val2str(args[0]), ctx->out);
+  putc('\n', ctx->out);
+  return int2val(0);
+}
+
+static c0_value vm_printint(struct c0vm_context *ctx, c0_value *args) {
+  fprintf(ctx->out, "%d", val2int(args[0]));
+  return int2val(0);
+}
+
+static c0_value vm_printchar(struct c0vm_context *ctx, c0_value *args) {
+  putc(val2int(args[0]), ctx->out);
+  return int2val(0);
+}
+
+static c0_value vm_printbool(struct c0vm_context *ctx, c0_value *args) {
+  fputs(val2int(args[0]) ? "true" : "false", ctx->out);
+  return int2val(0);
+}
+
+static c0_value vm_flush(struct c0vm_context *ctx, c0_value *args) {
+  (void)args;
+  fflush(ctx->out);
+  return int2val(0);
+}
+
+static c0_value vm_eof(struct c0vm_context *ctx, c0_value *args) {
+  (void)args;
+  int c = getc(ctx->in);
+  if (c == EOF) return int2val(1);
+  ungetc(c, ctx->in);
+  return int2val(0);
+}
+
+static c0_value vm_readline(struct c0vm_context *ctx, c0_value *args) {
+  (void)args;
+  fflush(ctx->out);  /* prompts should appear before we block */
+
+  size_t len = 0, cap = 80;
+  char *line = xmalloc(cap);
+  int c;
+  while ((c = getc(ctx->in)) != EOF && c != '\n') {
+    if (len + 1 == cap) {
+      cap *= 2;
+      char *bigger = xmalloc(cap);
+      memcpy(bigger, line, len);
+      free(line);
+      line = bigger;
+    }
+    line[len++] = c;
+  }
+  if (len > 0 && line[len-1] == '\r') len--;
+
+  char *s = c0vm_alloc(ctx, len + 1);
+  memcpy(s, line, len);
+  free(line);
+  return ptr2val(s);
+}
+
+/*** args ***/
+
+static void add_option(struct c0vm_context *ctx, int kind, c0_value *args) {
+  char *name = val2str(args[0]);  /* before allocating, as these can fail */
+  void *ptr = val2ptr(args[1]);
+  struct c0vm_option *o = xmalloc(sizeof(struct c0vm_option));
+  o->kind = kind;
+  o->name = name;
+  o->ptr = ptr;
+  o->next = ctx->options;
+  ctx->options = o;
+}
+
+static c0_value vm_args_flag(struct c0vm_context *ctx, c0_value *args) {
+  add_option(ctx, OPTION_FLAG, args);
+  return int2val(0);
+}
+
+static c0_value vm_args_int(struct c0vm_context *ctx, c0_value *args) {
+  add_option(ctx, OPTION_INT, args);
+  return int2val(0);
+}
+
+static c0_value vm_args_string(struct c0vm_context *ctx, c0_value *args) {
+  add_option(ctx, OPTION_STRING, args);
+  return int2val(0);
+}
+
+static struct c0vm_option *find_option(struct c0vm_context *ctx, char *arg) {
+  for (struct c0vm_option *o = ctx->options; o != NULL; o = o->next)
+    if (strcmp(o->name, arg) == 0) return o;
+  return NULL;
+}
+
+/* struct args { int argc; string[] argv; } with the arguments that aren't
+ * options, or NULL if an option is missing its value or has a bad one */
+static c0_value vm_args_parse(struct c0vm_context *ctx, c0_value *args) {
+  (void)args;
+  int n = ctx->argc > 1 ? ctx->argc - 1 : 0;
+  c0_array *rest = c0vm_alloc(ctx, 2*sizeof(int) + n * sizeof(char *));
+  rest->elt_size = sizeof(char *);
+  char **elems = (char **)((ubyte *)rest + 2*sizeof(int));  /* as in AADDS */
+
+  for (int i = 1; i < ctx->argc; i++) {
+    char *arg = ctx->argv[i];
+    struct c0vm_option *o = find_option(ctx, arg);
+    if (o == NULL) {
+      elems[rest->count++] = arg;
+      continue;
+    }
+    if (o->kind == OPTION_FLAG) {
+      *(char *)o->ptr = true;
+      continue;
+    }
+    if (i + 1 >= ctx->argc) return ptr2val(NULL);
+    char *value = ctx->argv[++i];
+    if (o->kind == OPTION_STRING) {
+      *(char **)o->ptr = value;
+    } else {
+      char *end;
+      errno = 0;
+      long x = strtol(value, &end, 10);
+      if (*value == '\0' || *end != '\0' || errno != 0
+          || x < INT_MIN || x > INT_MAX)
+        return ptr2val(NULL);
+      *(int *)o->ptr = x;
+    }
+  }
+
+  ubyte *result = c0vm_alloc(ctx, 2*sizeof(void *));
+  *(int *)result = rest->count;
+  *(c0_array **)(result + sizeof(void *)) = rest;
+  return ptr2val(result);
+}
+
+static c0vm_native_fn *const vm_natives[NATIVE_FUNCTION_COUNT] = {
+  [NATIVE_ARGS_FLAG] = vm_args_flag,
+  [NATIVE_ARGS_INT] = vm_args_int,
+  [NATIVE_ARGS_PARSE] = vm_args_parse,
+  [NATIVE_ARGS_STRING] = vm_args_string,
+
+  [NATIVE_EOF] = vm_eof,
+  [NATIVE_FLUSH] = vm_flush,
+  [NATIVE_PRINT] = vm_print,
+  [NATIVE_PRINTBOOL] = vm_printbool,
+  [NATIVE_PRINTCHAR] = vm_printchar,
+  [NATIVE_PRINTINT] = vm_printint,
+  [NATIVE_PRINTLN] = vm_println,
+  [NATIVE_READLINE] = vm_readline,
+};
+
+void natives_install(struct c0vm_context *ctx) {
+  REQUIRES(ctx != NULL);
+  memcpy(ctx->natives, vm_natives, sizeof(vm_natives));
+}
+
+bool native_builtin(uint16_t idx) {
+  return idx < NATIVE_FUNCTION_COUNT && vm_natives[idx] != NULL;
+}
+
+bool native_blocks(uint16_t idx) {
+  switch (idx) {
+  case NATIVE_EOF:
+  case NATIVE_READLINE:
+  case NATIVE_C_GETCH:
+  case NATIVE_FILE_CLOSE:
+  case NATIVE_FILE_EOF:
+  case NATIVE_FILE_READ:
+  case NATIVE_FILE_READLINE:
+  case NATIVE_IMAGE_LOAD:
+  case NATIVE_IMAGE_SAVE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*** names ***/
+
+/* The library name of each native, in native_function_table's order */
+const char *native_names[NATIVE_FUNCTION_COUNT] = {
+  /* 15411 */
+  "fadd",
+  "fdiv",
+  "fless",
+  "fmul",
+  "fsub",
+  "ftoi",
+  "itof",
+  "print_fpt",
+  "print_hex",
+  "print_int",
+  /* args */
+  "args_flag",
+  "args_int",
+  "args_parse",
+  "args_string",
+  /* conio */
+  "eof",
+  "flush",
+  "print",
+  "printbool",
+  "printchar",
+  "printint",
+  "println",
+  "readline",
+  /* curses */
+  "c_addch",
+  "c_cbreak",
+  "c_curs_set",
+  "c_delch",
+  "c_endwin",
+  "c_erase",
+  "c_getch",
+  "c_initscr",
+  "c_keypad",
+  "c_move",
+  "c_noecho",
+  "c_refresh",
+  "c_subwin",
+  "c_waddch",
+  "c_waddstr",
+  "c_wclear",
+  "c_werase",
+  "c_wmove",
+  "c_wrefresh",
+  "c_wstandend",
+  "c_wstandout",
+  "cc_getbegx",
+  "cc_getbegy",
+  "cc_getmaxx",
+  "cc_getmaxy",
+  "cc_getx",
+  "cc_gety",
+  "cc_highlight",
+  "cc_key_is_backspace",
+  "cc_key_is_down",
+  "cc_key_is_enter",
+  "cc_key_is_left",
+  "cc_key_is_right",
+  "cc_key_is_up",
+  "cc_wboldoff",
+  "cc_wboldon",
+  "cc_wdimoff",
+  "cc_wdimon",
+  "cc_wreverseoff",
+  "cc_wreverseon",
+  "cc_wunderoff",
+  "cc_wunderon",
+  /* file */
+  "file_close",
+  "file_closed",
+  "file_eof",
+  "file_read",
+  "file_readline",
+  /* img */
+  "image_clone",
+  "image_create",
+  "image_data",
+  "image_height",
+  "image_load",
+  "image_save",
+  "image_subimage",
+  "image_width",
+  /* parse */
+  "int_tokens",
+  "num_tokens",
+  "parse_bool",
+  "parse_int",
+  "parse_ints",
+  "parse_tokens",
+  /* string */
+  "char_chr",
+  "char_ord",
+  "string_charat",
+  "string_compare",
+  "string_equal",
+  "string_from_chararray",
+  "string_frombool",
+  "string_fromchar",
+  "string_fromint",
+  "string_join",
+  "string_length",
+  "string_sub",
+  "string_terminated",
+  "string_to_chararray",
+  "string_tolower",
+};
+
+int native_lookup(const char *name) {
+  for (int i = 0; i < NATIVE_FUNCTION_COUNT; i++)
+    if (strcmp(native_names[i], name) == 0) return i;
+  return -1;
+}
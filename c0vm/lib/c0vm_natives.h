@@ -0,0 +1,28 @@
+/* C0VM natives implemented by the VM
+ *
+ * The natives that depend on per-program state -- the args library and
+ * the conio functions that read or write standard input and output --
+ * are implemented here against the context instead of process globals.
+ */
+
+#include "c0vm_context.h"
+
+#ifndef _C0VM_NATIVES_H_
+#define _C0VM_NATIVES_H_
+
+/* Point ctx->natives at the VM's own implementations */
+void natives_install(struct c0vm_context *ctx);
+
+/* Whether the VM implements native_function_table[idx] itself, so that
+ * no library is needed for it */
+bool native_builtin(uint16_t idx);
+
+/* Whether native_function_table[idx] may wait on input or the file system */
+bool native_blocks(uint16_t idx);
+
+/* C0 names of the natives, like "string_length"; native_lookup(name) is
+ * the index of the native with that name, or -1 */
+extern const char *native_names[NATIVE_FUNCTION_COUNT];
+int native_lookup(const char *name);
+
+#endif /* _C0VM_NATIVES_H_ */
@@ -0,0 +1,376 @@
+/* C0VM load-time bytecode optimizer
+ *
+ * Idiom recognition: C0 has no memset/memcpy/memchr, so programs fill,
+ * copy and search arrays one element at a time.  We recognize the loops
+ * cc0 generates for this,
+ *
+ *   h+0   15 i                vload i
+ *   h+2   15 n                vload n
+ *   h+4   A1 00 06            if_icmplt body
+ *   h+7   A7 o1 o2            goto exit
+ *   h+10  ... body ...
+ *   step  15 i 10 01 60 36 i  i = i + 1
+ *         A7 o1 o2            goto h
+ *
+ * and replace the vload at h by AFILL, ACOPY or ASEARCH.  At run time
+ * these check bounds once and run the whole loop natively.
+ *
+ * Branch orientation: cc0 compiles conditionals as
+ *
+ *   pc    if<cond> +6
+ *   pc+3  goto L
+ *   pc+6  ...
+ *
+ * which costs one dispatch when cond holds and two when it doesn't.
+ * Where the coverage profile shows cond mostly fails, we rewrite this to
+ * if<!cond> L; goto +3, so that the common case is the cheap one.
+ *
+ * Intrinsics: invokenative of the small string and conio natives that
+ * string-processing programs call constantly is replaced by a dedicated
+ * instruction with the same operands, run inline in execute without the
+ * argument array, the table lookup or the library call.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_insn.h"
+#include "c0vm_coverage.h"
+#include "c0vm_optimize.h"
+
+#define LOOP_BODY 10  /* offset of the loop body from the loop head */
+#define LOOP_STEP 10  /* length of the i = i + 1, goto h sequence */
+
+/* Target of the branch instruction at P[pc] */
+static inline size_t branch_target(ubyte *P, size_t pc) {
+  return pc + (int16_t)(P[pc+1]<<8 | P[pc+2]);
+}
+
+static inline bool is_branch(ubyte op) {
+  return op == GOTO || (IF_CMPEQ <= op && op <= IF_ICMPLE);
+}
+
+/*** Matching ***/
+
+/* Bitmap of the pcs that some branch in the function jumps to */
+static bool *jump_targets(struct function_info *f) {
+  bool *T = xcalloc(f->code_length + 1, sizeof(bool));
+  size_t pc = 0;
+  while (pc < f->code_length) {
+    size_t len = insn_length(f->code[pc]);
+    if (len == 0 || pc + len > f->code_length) break;
+    if (is_branch(f->code[pc])) {
+      size_t t = branch_target(f->code, pc);
+      if (t <= f->code_length) T[t] = true;
+    }
+    pc += len;
+  }
+  return T;
+}
+
+/* No branch lands in [lo, hi) */
+static bool no_targets(bool *T, size_t lo, size_t hi) {
+  for (size_t k = lo; k < hi; k++)
+    if (T[k]) return false;
+  return true;
+}
+
+/* Loop header at h; on success *i, *n and *done are filled in */
+static bool match_header(ubyte *P, size_t len, size_t h,
+                         ubyte *i, ubyte *n, size_t *done) {
+  if (h + LOOP_BODY > len) return false;
+  if (P[h] != VLOAD || P[h+2] != VLOAD) return false;
+  if (P[h+4] != IF_ICMPLT || P[h+5] != 0 || P[h+6] != 6) return false;
+  if (P[h+7] != GOTO) return false;
+  *i = P[h+1];
+  *n = P[h+3];
+  *done = branch_target(P, h+7);
+  return *i != *n && *done <= len;
+}
+
+/* i = i + 1; goto h at P[at] */
+static bool match_step(ubyte *P, size_t len, size_t at, ubyte i, size_t h) {
+  if (at + LOOP_STEP > len) return false;
+  return P[at] == VLOAD && P[at+1] == i
+    && P[at+2] == BIPUSH && P[at+3] == 1
+    && P[at+4] == IADD
+    && P[at+5] == VSTORE && P[at+6] == i
+    && P[at+7] == GOTO && branch_target(P, at+7) == h;
+}
+
+/* &a[i], that is vload a; vload i; aadds, at P[at] */
+static bool match_elem(ubyte *P, size_t len, size_t at, ubyte i) {
+  if (at + 5 > len) return false;
+  return P[at] == VLOAD && P[at+1] != i
+    && P[at+2] == VLOAD && P[at+3] == i
+    && P[at+4] == AADDS;
+}
+
+/* A loop-invariant int: bipush b, or vload x with x != i */
+static bool match_scalar(ubyte *P, size_t len, size_t at, ubyte i) {
+  if (at + 2 > len) return false;
+  return P[at] == BIPUSH || (P[at] == VLOAD && P[at+1] != i);
+}
+
+/* Layout of the ASEARCH body: the right hand side is either a scalar or
+ * b[i]; the compare is if_cmpeq/if_cmpne +6 then goto step. */
+static inline bool search_scalar_rhs(ubyte *P, size_t h) {
+  return P[h+18] == IF_CMPEQ || P[h+18] == IF_CMPNE;
+}
+
+static inline size_t search_compare(ubyte *P, size_t h) {
+  return search_scalar_rhs(P, h) ? h+18 : h+22;
+}
+
+/* a[i] = x; with x a scalar, as a char or int store */
+static bool match_fill(ubyte *P, size_t len, size_t h, ubyte i, bool *T) {
+  size_t b = h + LOOP_BODY;
+  if (!match_elem(P, len, b, i)) return false;
+  if (!match_scalar(P, len, b+5, i)) return false;
+  if (b+8 > len || (P[b+7] != CMSTORE && P[b+7] != IMSTORE)) return false;
+  return match_step(P, len, b+8, i, h)
+    && no_targets(T, b+1, b+8+LOOP_STEP);
+}
+
+/* b[i] = a[i]; over char arrays */
+static bool match_copy(ubyte *P, size_t len, size_t h, ubyte i, bool *T) {
+  size_t b = h + LOOP_BODY;
+  if (!match_elem(P, len, b, i) || !match_elem(P, len, b+5, i)) return false;
+  if (b+12 > len || P[b+10] != CMLOAD || P[b+11] != CMSTORE) return false;
+  return match_step(P, len, b+12, i, h)
+    && no_targets(T, b+1, b+12+LOOP_STEP);
+}
+
+/* if (a[i] == rhs) ... or if (a[i] != rhs) ... over char arrays,
+ * where the then-branch is arbitrary code */
+static bool match_search(ubyte *P, size_t len, size_t h, ubyte i, bool *T) {
+  size_t b = h + LOOP_BODY;
+  if (!match_elem(P, len, b, i) || b+6 > len || P[b+5] != CMLOAD)
+    return false;
+  if (b+9 > len) return false;
+  if (search_scalar_rhs(P, h)) {
+    if (!match_scalar(P, len, b+6, i)) return false;
+  } else {
+    if (!match_elem(P, len, b+6, i) || b+12 > len || P[b+11] != CMLOAD)
+      return false;
+  }
+  size_t c = search_compare(P, h);
+  if (c + 6 > len) return false;
+  if (P[c] != IF_CMPEQ && P[c] != IF_CMPNE) return false;
+  if (P[c+1] != 0 || P[c+2] != 6 || P[c+3] != GOTO) return false;
+  size_t step = branch_target(P, c+3);
+  return match_step(P, len, step, i, h)
+    && no_targets(T, b+1, c+6)
+    && no_targets(T, step+1, step+LOOP_STEP);
+}
+
+/* The negation of conditional op, or 0 if we don't negate it */
+static ubyte negate(ubyte op) {
+  switch (op) {
+  case IF_CMPEQ: return IF_CMPNE;
+  case IF_CMPNE: return IF_CMPEQ;
+  case IF_ICMPLT: return IF_ICMPGE;
+  case IF_ICMPGE: return IF_ICMPLT;
+  case IF_ICMPGT: return IF_ICMPLE;
+  case IF_ICMPLE: return IF_ICMPGT;
+  default: return 0;
+  }
+}
+
+static void orient_branches(size_t fn, struct function_info *f, bool *T) {
+  ubyte *P = f->code;
+  size_t len = f->code_length;
+
+  size_t pc = 0;
+  while (pc < len) {
+    size_t ilen = insn_length(P[pc]);
+    if (ilen == 0) break;
+
+    uint64_t taken, not_taken;
+    if (negate(P[pc]) != 0 && pc + 6 <= len
+        && P[pc+1] == 0 && P[pc+2] == 6 && P[pc+3] == GOTO
+        && !T[pc+3]  /* else someone else relies on that goto */
+        && coverage_branch(fn, pc, &taken, &not_taken)
+        && not_taken > taken) {
+      int32_t offset = (int32_t)branch_target(P, pc+3) - (int32_t)pc;
+      if (INT16_MIN <= offset && offset <= INT16_MAX) {
+        P[pc] = negate(P[pc]);
+        P[pc+1] = (offset >> 8) & 0xff;
+        P[pc+2] = offset & 0xff;
+        P[pc+4] = 0;
+        P[pc+5] = 3;
+        coverage_inverted(fn, pc);
+      }
+    }
+    pc += ilen;
+  }
+}
+
+/* The intrinsic for native_function_table[idx], or 0.  STRCHARAT, STREQ
+ * and STRCMP take two arguments and the others one. */
+static ubyte intrinsic(uint16_t idx) {
+  switch (idx) {
+  case NATIVE_STRING_LENGTH: return STRLEN;
+  case NATIVE_STRING_CHARAT: return STRCHARAT;
+  case NATIVE_STRING_EQUAL: return STREQ;
+  case NATIVE_STRING_COMPARE: return STRCMP;
+  case NATIVE_CHAR_ORD: return CHARORD;
+  case NATIVE_CHAR_CHR: return CHARCHR;
+  case NATIVE_PRINT: return PRINTS;
+  case NATIVE_PRINTLN: return PRINTLN;
+  case NATIVE_PRINTINT: return PRINTINT;
+  case NATIVE_PRINTCHAR: return PRINTCHAR;
+  case NATIVE_PRINTBOOL: return PRINTBOOL;
+  default: return 0;
+  }
+}
+
+static void optimize_function(struct bc0_file *bc0, size_t fn,
+                              struct function_info *f) {
+  ubyte *P = f->code;
+  size_t len = f->code_length;
+  bool *T = jump_targets(f);
+
+  if (c0_coverage) orient_branches(fn, f, T);
+
+  size_t pc = 0;
+  while (pc < len) {
+    size_t ilen = insn_length(P[pc]);
+    if (ilen == 0) break;  /* not bytecode we understand; leave it be */
+
+    ubyte i, n;
+    size_t done;
+    if (P[pc] == VLOAD && match_header(P, len, pc, &i, &n, &done)
+        && no_targets(T, pc+1, pc+LOOP_BODY)) {
+      if (match_fill(P, len, pc, i, T)) P[pc] = AFILL;
+      else if (match_copy(P, len, pc, i, T)) P[pc] = ACOPY;
+      else if (match_search(P, len, pc, i, T)) P[pc] = ASEARCH;
+    }
+    if (P[pc] == INVOKENATIVE) {
+      uint16_t k = (uint16_t)P[pc+1] << 8 | P[pc+2];
+      if (k < bc0->native_count) {
+        struct native_info *ni = &bc0->native_pool[k];
+        ubyte op = intrinsic(ni->function_table_index);
+        size_t nargs = op == STRCHARAT || op == STREQ || op == STRCMP ? 2 : 1;
+        if (op != 0 && ni->num_args == nargs) P[pc] = op;
+      }
+    }
+    pc += ilen;
+  }
+  free(T);
+}
+
+void optimize_program(struct bc0_file *bc0) {
+  REQUIRES(bc0 != NULL);
+
+  for (size_t j = 0; j < bc0->function_count; j++)
+    optimize_function(bc0, j, &bc0->function_pool[j]);
+}
+
+/*** Execution ***/
+
+static inline bool int_var(c0_value *V, ubyte x, int32_t *out) {
+  if (V[x].kind != C0_INTEGER) return false;
+  *out = V[x].payload.i;
+  return true;
+}
+
+/* Value of bipush b or vload x at P[at] */
+static inline bool scalar(ubyte *P, size_t at, c0_value *V, int32_t *out) {
+  if (P[at] == BIPUSH) {
+    *out = (int8_t)P[at+1];
+    return true;
+  }
+  return int_var(V, P[at+1], out);
+}
+
+/* The elements of array V[a], if it can be indexed at [lo, hi) and
+ * has elements of size elt_size; NULL otherwise */
+static ubyte *array_range(c0_value *V, ubyte a, int32_t lo, int32_t hi,
+                          int elt_size) {
+  if (V[a].kind != C0_POINTER) return NULL;
+  c0_array *arr = V[a].payload.p;
+  if (arr == NULL || lo < 0 || hi > arr->count) return NULL;
+  if (arr->elt_size != elt_size) return NULL;
+  return (ubyte *)arr + 2*sizeof(int);  /* as in AADDS */
+}
+
+/* Loop bounds [*lo, *hi) of the loop headed at P[pc]; false if the
+ * loop isn't entered, in which case there's nothing to gain. */
+static inline bool loop_bounds(ubyte *P, size_t pc, c0_value *V,
+                               int32_t *lo, int32_t *hi) {
+  return int_var(V, P[pc+1], lo) && int_var(V, P[pc+3], hi) && *lo < *hi;
+}
+
+bool idiom_fill(ubyte *P, size_t pc, c0_value *V, size_t *next) {
+  int32_t lo, hi, x;
+  if (!loop_bounds(P, pc, V, &lo, &hi)) return false;
+  if (!scalar(P, pc+15, V, &x)) return false;
+
+  bool chars = P[pc+17] == CMSTORE;
+  ubyte *elems = array_range(V, P[pc+11], lo, hi, chars ? 1 : 4);
+  if (elems == NULL) return false;
+
+  if (chars) {
+    memset(elems + lo, x & 0x7f, hi - lo);
+  } else {
+    int *E = (int *)elems;
+    for (int32_t j = lo; j < hi; j++) E[j] = x;
+  }
+
+  V[P[pc+1]] = int2val(hi);
+  *next = branch_target(P, pc+7);
+  return true;
+}
+
+bool idiom_copy(ubyte *P, size_t pc, c0_value *V, size_t *next) {
+  int32_t lo, hi;
+  if (!loop_bounds(P, pc, V, &lo, &hi)) return false;
+
+  ubyte *dst = array_range(V, P[pc+11], lo, hi, 1);
+  ubyte *src = array_range(V, P[pc+16], lo, hi, 1);
+  if (dst == NULL || src == NULL) return false;
+
+  /* dst and src may be the same array, so copy forward like the loop */
+  for (int32_t j = lo; j < hi; j++) dst[j] = src[j] & 0x7f;
+
+  V[P[pc+1]] = int2val(hi);
+  *next = branch_target(P, pc+7);
+  return true;
+}
+
+bool idiom_search(ubyte *P, size_t pc, c0_value *V, size_t *next) {
+  int32_t lo, hi;
+  if (!loop_bounds(P, pc, V, &lo, &hi)) return false;
+
+  ubyte *A = array_range(V, P[pc+11], lo, hi, 1);
+  if (A == NULL) return false;
+
+  size_t c = search_compare(P, pc);
+  bool eq = P[c] == IF_CMPEQ;
+  int32_t j = lo;
+
+  if (search_scalar_rhs(P, pc)) {
+    int32_t x;
+    if (!scalar(P, pc+16, V, &x)) return false;
+    if (eq && 0 <= x && x <= 0xff) {
+      ubyte *hit = memchr(A + lo, x, hi - lo);
+      j = hit == NULL ? hi : hit - A;
+    } else if (eq) {
+      j = hi;  /* cmload yields 0..255, so x never matches */
+    } else {
+      while (j < hi && A[j] == x) j++;
+    }
+  } else {
+    ubyte *B = array_range(V, P[pc+17], lo, hi, 1);
+    if (B == NULL) return false;
+    while (j < hi && (A[j] == B[j]) != eq) j++;
+  }
+
+  V[P[pc+1]] = int2val(j);
+  *next = j < hi ? c + 6 : branch_target(P, pc+7);
+  return true;
+}
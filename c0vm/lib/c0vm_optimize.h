@@ -0,0 +1,26 @@
+/* C0VM load-time bytecode optimizer
+ *
+ * Rewrites recognized bytecode patterns in place into internal
+ * instructions (see the end of enum instructions in c0vm.h).  Rewrites
+ * never change code length or jump offsets, and every internal
+ * instruction can fall back to the original bytecode it replaced.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_OPTIMIZE_H_
+#define _C0VM_OPTIMIZE_H_
+
+void optimize_program(struct bc0_file *bc0);
+
+/* Idiom executors for AFILL, ACOPY and ASEARCH at P[pc].  They return
+ * false, changing nothing, if the loop can't be run in bulk (wrong
+ * value kinds, NULL arrays, out of bounds); the caller then executes
+ * the original VLOAD at P[pc].  Otherwise the whole loop has run and
+ * *next is the pc to continue at. */
+bool idiom_fill(ubyte *P, size_t pc, c0_value *V, size_t *next);
+bool idiom_copy(ubyte *P, size_t pc, c0_value *V, size_t *next);
+bool idiom_search(ubyte *P, size_t pc, c0_value *V, size_t *next);
+
+#endif /* _C0VM_OPTIMIZE_H_ */
@@ -0,0 +1,235 @@
+/* C0VM execution profiler
+ *
+ * The profiler keeps its own shadow of the call stack, with the time
+ * each active call started and the time spent in its callees so far.
+ * The report is written by an atexit handler, so it is produced both
+ * when execute returns and when the C0 program calls error().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_insn.h"
+#include "c0vm_profile.h"
+
+#define TOP_PAIRS 40
+
+bool c0_profiling = false;
+
+struct fn_stats {
+  uint64_t calls;
+  uint64_t insns;
+  uint64_t inclusive;  /* cycles, not counting recursive re-entries twice */
+  uint64_t exclusive;  /* cycles, not counting callees */
+  size_t active;       /* activations currently on the call stack */
+};
+
+struct call_record {
+  size_t fn;
+  uint64_t start;
+  uint64_t callees;    /* cycles spent in callees so far */
+};
+
+static FILE *report;
+static size_t function_count;
+static char **names;
+
+static uint64_t total_insns;
+static uint64_t opcode_count[256];
+static uint64_t pair_count[256][256];
+static int last_opcode = -1;
+static uint64_t total_allocs;
+static uint64_t total_alloc_bytes;
+
+static struct fn_stats *fns;
+static struct call_record *calls;
+static size_t depth;
+static size_t capacity;
+
+/* Cycle counter on x86, nanoseconds elsewhere */
+static inline uint64_t now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void profile_insn(ubyte opcode) {
+  total_insns++;
+  opcode_count[opcode]++;
+  if (last_opcode >= 0) pair_count[last_opcode][opcode]++;
+  last_opcode = opcode;
+  if (depth > 0) fns[calls[depth-1].fn].insns++;
+}
+
+void profile_alloc(size_t bytes) {
+  total_allocs++;
+  total_alloc_bytes += bytes;
+}
+
+void profile_call(size_t fn) {
+  REQUIRES(fn < function_count);
+
+  if (depth == capacity) {
+    capacity = capacity == 0 ? 64 : 2 * capacity;
+    calls = realloc(calls, capacity * sizeof(struct call_record));
+    if (calls == NULL) {
+      fprintf(stderr, "allocation failed\n");
+      abort();
+    }
+  }
+  calls[depth].fn = fn;
+  calls[depth].callees = 0;
+  fns[fn].calls++;
+  fns[fn].active++;
+  depth++;
+  calls[depth-1].start = now();
+}
+
+void profile_return(void) {
+  uint64_t t = now();
+  REQUIRES(depth > 0);
+
+  depth--;
+  struct call_record *c = &calls[depth];
+  uint64_t elapsed = t - c->start;
+  struct fn_stats *f = &fns[c->fn];
+  f->active--;
+  if (f->active == 0) f->inclusive += elapsed;
+  f->exclusive += elapsed - c->callees;
+  if (depth > 0) calls[depth-1].callees += elapsed;
+}
+
+/* Copies of the function names, as the program is freed before the
+ * profilers report */
+char **profile_copy_names(struct bc0_file *bc0) {
+  char **copy = xcalloc(bc0->function_count, sizeof(char *));
+  for (size_t fn = 0; fn < bc0->function_count; fn++) {
+    char *name = bc0->function_pool[fn].name;
+    if (name == NULL) continue;
+    copy[fn] = xcalloc(strlen(name) + 1, sizeof(char));
+    strcpy(copy[fn], name);
+  }
+  return copy;
+}
+
+void profile_free_names(char **copy, size_t count) {
+  for (size_t fn = 0; fn < count; fn++) free(copy[fn]);
+  free(copy);
+}
+
+const char *profile_fn_name(char **copy, size_t fn) {
+  static char buf[32];
+  if (copy[fn] != NULL) return copy[fn];
+  sprintf(buf, "function_%zu", fn);
+  return buf;
+}
+
+double profile_percent(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+static const char *op_name(ubyte op) {
+  static char buf[2][8];
+  static int which = 0;
+  const char *name = insn_name(op);
+  if (name != NULL) return name;
+  which = !which;
+  sprintf(buf[which], "0x%02x", (unsigned)op);
+  return buf[which];
+}
+
+/* qsort comparators, sorting index arrays in decreasing order */
+static uint64_t *sort_key;
+
+static int by_key_desc(const void *a, const void *b) {
+  uint64_t x = sort_key[*(const size_t *)a];
+  uint64_t y = sort_key[*(const size_t *)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static size_t *sorted_indices(uint64_t *key, size_t n) {
+  size_t *idx = xcalloc(n, sizeof(size_t));
+  for (size_t k = 0; k < n; k++) idx[k] = k;
+  sort_key = key;
+  qsort(idx, n, sizeof(size_t), by_key_desc);
+  return idx;
+}
+
+static void profile_report(void) {
+  /* Close calls still active, e.g. when the program called error() */
+  while (depth > 0) profile_return();
+
+  fprintf(report, "# c0vm profile: %" PRIu64 " instructions\n"
+          "# c0vm heap: %" PRIu64 " allocations, %" PRIu64 " bytes\n\n",
+          total_insns, total_allocs, total_alloc_bytes);
+
+  fprintf(report, "# opcodes\n%14s %7s  %s\n", "count", "%", "opcode");
+  size_t *ops = sorted_indices(opcode_count, 256);
+  for (size_t k = 0; k < 256 && opcode_count[ops[k]] > 0; k++)
+    fprintf(report, "%14" PRIu64 " %6.2f%%  %s\n", opcode_count[ops[k]],
+            profile_percent(opcode_count[ops[k]], total_insns),
+            op_name(ops[k]));
+  free(ops);
+
+  fprintf(report, "\n# opcode pairs (top %d)\n%14s %7s  %s\n",
+          TOP_PAIRS, "count", "%", "pair");
+  size_t *pairs = sorted_indices(&pair_count[0][0], 256 * 256);
+  for (size_t k = 0; k < TOP_PAIRS && (&pair_count[0][0])[pairs[k]] > 0; k++) {
+    uint64_t n = (&pair_count[0][0])[pairs[k]];
+    fprintf(report, "%14" PRIu64 " %6.2f%%  %s %s\n", n,
+            profile_percent(n, total_insns), op_name(pairs[k] / 256),
+            op_name(pairs[k] % 256));
+  }
+  free(pairs);
+
+  uint64_t *excl = xcalloc(function_count, sizeof(uint64_t));
+  uint64_t total_cycles = 0;
+  for (size_t fn = 0; fn < function_count; fn++) {
+    excl[fn] = fns[fn].exclusive;
+    total_cycles += excl[fn];
+  }
+  fprintf(report, "\n# functions, by exclusive cycles\n"
+          "%10s %14s %16s %16s %7s  %s\n",
+          "calls", "instructions", "inclusive", "exclusive", "%", "function");
+  size_t *order = sorted_indices(excl, function_count);
+  for (size_t k = 0; k < function_count; k++) {
+    struct fn_stats *f = &fns[order[k]];
+    if (f->calls == 0) break;
+    fprintf(report, "%10" PRIu64 " %14" PRIu64 " %16" PRIu64 " %16" PRIu64
+            " %6.2f%%  %s\n", f->calls, f->insns, f->inclusive, f->exclusive,
+            profile_percent(f->exclusive, total_cycles),
+            profile_fn_name(names, order[k]));
+  }
+  free(order);
+  free(excl);
+
+  fclose(report);
+  profile_free_names(names, function_count);
+  free(fns);
+  free(calls);
+}
+
+void profile_init(struct bc0_file *bc0, char *filename) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+
+  report = fopen(filename, "w");
+  if (report == NULL) {
+    perror("Couldn't open $C0_PROFILE");
+    exit(EXIT_FAILURE);
+  }
+  function_count = bc0->function_count;
+  fns = xcalloc(function_count, sizeof(struct fn_stats));
+  names = profile_copy_names(bc0);
+  c0_profiling = true;
+  atexit(profile_report);
+}
@@ -0,0 +1,31 @@
+/* C0VM execution profiler
+ *
+ * Counts executions per opcode, per pair of consecutive opcodes and per
+ * function, cycles spent per function, inclusive and exclusive of its
+ * callees, and allocations in the C0 heap.  Enabled by setting
+ * C0_PROFILE to the file the report is written to when the program
+ * exits.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_PROFILE_H_
+#define _C0VM_PROFILE_H_
+
+extern bool c0_profiling;  /* true once profile_init has been called */
+
+void profile_init(struct bc0_file *bc0, char *filename);
+
+void profile_insn(ubyte opcode);   /* before executing each instruction */
+void profile_call(size_t fn);      /* on entry to function_pool[fn] */
+void profile_return(void);         /* on return from the current function */
+void profile_alloc(size_t bytes);  /* on each allocation in the C0 heap */
+
+/* For all the profilers, which report after the program is freed */
+char **profile_copy_names(struct bc0_file *bc0);
+void profile_free_names(char **names, size_t count);
+const char *profile_fn_name(char **names, size_t fn);
+double profile_percent(uint64_t part, uint64_t whole);
+
+#endif /* _C0VM_PROFILE_H_ */
@@ -0,0 +1,267 @@
+/* C0VM record and replay of native calls
+ *
+ * A log is a header -- magic, format, program hash and the program's
+ * arguments after argv[0] -- and then a record per logged call: the
+ * native's index, a tag and the result.  Numbers are LEB128 varints,
+ * with ints zigzag-encoded first.
+ *
+ *   INT     the int
+ *   NULL
+ *   STRING  length, bytes
+ *   ARRAY   id, count, element size, elements (from image_data)
+ *   OPAQUE  id (a file, window or image, which C0 can't look into)
+ *   SAME    id of a pointer an earlier call returned
+ *
+ * Pointers other than strings keep their identity through a replay: a
+ * native returning the same image or array twice gives the same
+ * pointer both times, and each opaque pointer becomes a distinct
+ * one-byte block of the C0 heap.  Programs only pass those back to
+ * logged natives, which replay doesn't call.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_c0ffi.h"
+#include "c0vm_context.h"
+#include "c0vm_coverage.h"
+#include "c0vm_natives.h"
+#include "c0vm_replay.h"
+
+#define MAGIC 0x52523043u  /* "C0RR" */
+#define FORMAT 1
+
+enum tag { TAG_INT, TAG_NULL, TAG_STRING, TAG_ARRAY, TAG_OPAQUE, TAG_SAME };
+
+bool c0_recording = false;
+bool c0_replaying = false;
+
+static FILE *log_file;
+static char *log_name;
+
+/* By id: the pointers natives returned when recording, and what stands
+ * in for them when replaying */
+static void **pointers;
+static size_t npointers;
+static size_t capacity;
+
+bool replay_logged(uint16_t idx) {
+  /* curses, file and image are consecutive */
+  return idx == NATIVE_EOF || idx == NATIVE_READLINE
+      || (NATIVE_C_ADDCH <= idx && idx <= NATIVE_IMAGE_WIDTH);
+}
+
+static size_t remember(void *p) {
+  if (npointers == capacity) {
+    capacity = capacity == 0 ? 16 : 2 * capacity;
+    void **bigger = xcalloc(capacity, sizeof(void *));
+    if (npointers > 0) memcpy(bigger, pointers, npointers * sizeof(void *));
+    free(pointers);
+    pointers = bigger;
+  }
+  pointers[npointers] = p;
+  return npointers++;
+}
+
+static void log_error(const char *message) {
+  fprintf(stderr, "Error: %s: %s\n", log_name, message);
+  exit(EXIT_FAILURE);
+}
+
+static void close_log(void) {
+  if (fclose(log_file) != 0 && c0_recording) perror(log_name);
+  free(pointers);
+}
+
+static void open_log(char *filename, const char *mode) {
+  log_file = fopen(filename, mode);
+  if (log_file == NULL) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  log_name = filename;
+  atexit(close_log);
+}
+
+/*** Recording ***/
+
+static void put_bytes(const void *p, size_t n) {
+  if (n > 0 && fwrite(p, n, 1, log_file) != 1) {
+    perror(log_name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void put_byte(uint8_t b) {
+  put_bytes(&b, 1);
+}
+
+static void put_varint(uint64_t x) {
+  while (x >= 0x80) {
+    put_byte((x & 0x7F) | 0x80);
+    x >>= 7;
+  }
+  put_byte(x);
+}
+
+static void put_string(const char *s, size_t len) {
+  put_varint(len);
+  put_bytes(s, len);
+}
+
+void record_init(struct bc0_file *bc0, int argc, char **argv,
+                 char *filename) {
+  REQUIRES(bc0 != NULL && argc >= 1 && argv != NULL && filename != NULL);
+
+  open_log(filename, "wb");
+  uint32_t magic = MAGIC, format = FORMAT;
+  uint64_t hash = program_hash(bc0);
+  put_bytes(&magic, sizeof(magic));
+  put_bytes(&format, sizeof(format));
+  put_bytes(&hash, sizeof(hash));
+  put_varint(argc - 1);
+  for (int i = 1; i < argc; i++) put_string(argv[i], strlen(argv[i]));
+  c0_recording = true;
+}
+
+void record_native(uint16_t idx, c0_value result) {
+  REQUIRES(c0_recording && replay_logged(idx));
+
+  put_byte(idx);
+  if (result.kind == C0_INTEGER) {
+    uint32_t i = result.payload.i;
+    put_byte(TAG_INT);
+    put_varint((i << 1) ^ (uint32_t)-(i >> 31));
+    return;
+  }
+
+  void *p = result.payload.p;
+  if (p == NULL) {
+    put_byte(TAG_NULL);
+  } else if (idx == NATIVE_READLINE || idx == NATIVE_FILE_READLINE) {
+    put_byte(TAG_STRING);
+    put_string(p, strlen(p));
+  } else {
+    for (size_t id = 0; id < npointers; id++) {
+      if (pointers[id] == p) {
+        put_byte(TAG_SAME);
+        put_varint(id);
+        return;
+      }
+    }
+    size_t id = remember(p);
+    if (idx == NATIVE_IMAGE_DATA) {
+      c0_array *a = p;
+      put_byte(TAG_ARRAY);
+      put_varint(id);
+      put_varint(a->count);
+      put_varint(a->elt_size);
+      put_bytes((uint8_t *)a + 2 * sizeof(int), (size_t)a->count * a->elt_size);
+    } else {
+      put_byte(TAG_OPAQUE);
+      put_varint(id);
+    }
+  }
+}
+
+/*** Replaying ***/
+
+static void get_bytes(void *p, size_t n) {
+  if (n > 0 && fread(p, n, 1, log_file) != 1)
+    log_error("the log ended before the program did");
+}
+
+static uint8_t get_byte(void) {
+  uint8_t b;
+  get_bytes(&b, 1);
+  return b;
+}
+
+static uint64_t get_varint(void) {
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t b = get_byte();
+    x |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return x;
+  }
+  log_error("bad number");
+  return 0;
+}
+
+void replay_init(struct bc0_file *bc0, int argc, char **argv,
+                 char *filename) {
+  REQUIRES(bc0 != NULL && argc >= 1 && argv != NULL && filename != NULL);
+
+  open_log(filename, "rb");
+  uint32_t magic, format;
+  uint64_t hash;
+  get_bytes(&magic, sizeof(magic));
+  get_bytes(&format, sizeof(format));
+  if (magic != MAGIC || format != FORMAT) log_error("not a c0vm native log");
+  get_bytes(&hash, sizeof(hash));
+  if (hash != program_hash(bc0)) log_error("recorded from another program");
+
+  bool same = get_varint() == (uint64_t)(argc - 1);
+  for (int i = 1; same && i < argc; i++) {
+    size_t len = get_varint();
+    same = len == strlen(argv[i]);
+    for (size_t j = 0; same && j < len; j++) same = get_byte() == argv[i][j];
+  }
+  if (!same) log_error("recorded with other arguments");
+  c0_replaying = true;
+}
+
+c0_value replay_native(struct c0vm_context *ctx, uint16_t idx) {
+  REQUIRES(c0_replaying && replay_logged(idx));
+
+  uint8_t logged = get_byte();
+  if (logged != idx) {
+    fprintf(stderr, "Error: %s: replay diverged: the program called %s, "
+            "the log has %s\n", log_name, native_names[idx],
+            logged < NATIVE_FUNCTION_COUNT ? native_names[logged] : "?");
+    exit(EXIT_FAILURE);
+  }
+
+  switch (get_byte()) {
+  case TAG_INT: {
+    uint32_t z = get_varint();
+    return int2val((int32_t)((z >> 1) ^ -(z & 1)));
+  }
+  case TAG_NULL:
+    return ptr2val(NULL);
+  case TAG_STRING: {
+    size_t len = get_varint();
+    char *s = c0vm_alloc(ctx, len + 1);
+    get_bytes(s, len);
+    return ptr2val(s);
+  }
+  case TAG_ARRAY: {
+    if (get_varint() != npointers) log_error("bad pointer id");
+    uint64_t count = get_varint();
+    uint64_t elt_size = get_varint();
+    if (count > INT32_MAX || elt_size > INT32_MAX) log_error("bad array");
+    c0_array *a = c0vm_alloc(ctx, sizeof(c0_array) + count * elt_size);
+    a->count = count;
+    a->elt_size = elt_size;
+    get_bytes((uint8_t *)a + 2 * sizeof(int), count * elt_size);
+    remember(a);
+    return ptr2val(a);
+  }
+  case TAG_OPAQUE: {
+    if (get_varint() != npointers) log_error("bad pointer id");
+    void *p = c0vm_alloc(ctx, 1);
+    remember(p);
+    return ptr2val(p);
+  }
+  case TAG_SAME: {
+    uint64_t id = get_varint();
+    if (id >= npointers) log_error("bad pointer id");
+    return ptr2val(pointers[id]);
+  }
+  }
+  log_error("bad record");
+  return ptr2val(NULL);
+}
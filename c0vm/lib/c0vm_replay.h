@@ -0,0 +1,38 @@
+/* C0VM record and replay of native calls
+ *
+ * Setting C0_RECORD to a file logs the result of every call the program
+ * makes to a native that reads input or depends on the outside world --
+ * readline, eof, the file, curses and image libraries -- and C0_REPLAY
+ * to such a log runs the program again with those calls answered from
+ * it instead of made.  Replay needs the same program and arguments, and
+ * neither reads input nor touches the terminal or any files, so
+ * interactive runs can be repeated as deterministic benchmarks.  Other
+ * natives, which only compute or write output, run as usual.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+#include "c0vm_context.h"
+
+#ifndef _C0VM_REPLAY_H_
+#define _C0VM_REPLAY_H_
+
+extern bool c0_recording;  /* true once record_init has been called */
+extern bool c0_replaying;  /* true once replay_init has been called */
+
+void record_init(struct bc0_file *bc0, int argc, char **argv,
+                 char *filename);
+void replay_init(struct bc0_file *bc0, int argc, char **argv,
+                 char *filename);
+
+/* Whether calls to native idx are recorded and replayed */
+bool replay_logged(uint16_t idx);
+
+/* After the program called native idx and got result */
+void record_native(uint16_t idx, c0_value result);
+
+/* The recorded result of the program's next call, which is to native
+ * idx; pointers it returns are allocated in ctx */
+c0_value replay_native(struct c0vm_context *ctx, uint16_t idx);
+
+#endif /* _C0VM_REPLAY_H_ */
@@ -0,0 +1,164 @@
+/* C0VM sampling profiler
+ *
+ * execute keeps a shadow stack of function indices and the current pc
+ * up to date; the SIGPROF handler reads them and counts the sample in
+ * a preallocated hash table of distinct stacks.  The handler neither
+ * allocates nor does I/O; everything is written out by an atexit
+ * handler.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_profile.h"
+#include "c0vm_sample.h"
+
+#define MAX_DEPTH 65536  /* deeper calls are not recorded */
+#define MAX_FRAMES 128   /* innermost frames kept per sample */
+#define TABLE_SIZE 8192  /* distinct stacks, a power of 2 */
+#define MAX_PROBES 64
+
+bool c0_sampling = false;
+
+struct stack_entry {
+  uint64_t count;
+  uint32_t hash;
+  uint16_t pc;
+  uint16_t nframes;
+  bool truncated;              /* outer frames were dropped */
+  uint16_t frames[MAX_FRAMES]; /* outermost first */
+};
+
+static volatile uint16_t shadow[MAX_DEPTH];
+static volatile sig_atomic_t depth;
+static volatile sig_atomic_t cur_pc;
+
+static struct stack_entry *table;
+static volatile sig_atomic_t dropped;
+
+static FILE *out;
+static size_t function_count;
+static char **names;
+
+void sample_pc(size_t pc) {
+  cur_pc = pc;
+}
+
+void sample_call(size_t fn) {
+  REQUIRES(fn < function_count);
+  if (depth < MAX_DEPTH) shadow[depth] = fn;
+  depth++;
+}
+
+void sample_return(void) {
+  REQUIRES(depth > 0);
+  depth--;
+}
+
+static void on_sample(int sig) {
+  (void)sig;
+  int d = depth < MAX_DEPTH ? depth : MAX_DEPTH;
+  if (d == 0) return;
+  int n = d < MAX_FRAMES ? d : MAX_FRAMES;
+  int first = d - n;
+  uint16_t pc = cur_pc;
+
+  /* FNV-1a over the frames and pc */
+  uint32_t h = 2166136261u;
+  for (int k = first; k < d; k++) h = (h ^ shadow[k]) * 16777619u;
+  h = (h ^ pc) * 16777619u;
+
+  for (uint32_t probe = 0; probe < MAX_PROBES; probe++) {
+    struct stack_entry *e = &table[(h + probe) & (TABLE_SIZE - 1)];
+    if (e->count == 0) {
+      e->hash = h;
+      e->pc = pc;
+      e->nframes = n;
+      e->truncated = first > 0;
+      for (int k = 0; k < n; k++) e->frames[k] = shadow[first + k];
+      e->count = 1;
+      return;
+    }
+    if (e->hash == h && e->pc == pc && e->nframes == n
+        && e->truncated == (first > 0)) {
+      bool same = true;
+      for (int k = 0; k < n && same; k++)
+        same = e->frames[k] == shadow[first + k];
+      if (same) {
+        e->count++;
+        return;
+      }
+    }
+  }
+  dropped++;
+}
+
+static void sample_report(void) {
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  for (size_t k = 0; k < TABLE_SIZE; k++) {
+    struct stack_entry *e = &table[k];
+    if (e->count == 0) continue;
+    if (e->truncated) fprintf(out, "[truncated];");
+    for (size_t f = 0; f < e->nframes; f++)
+      fprintf(out, "%s;", profile_fn_name(names, e->frames[f]));
+    fprintf(out, "@%u %" PRIu64 "\n", (unsigned)e->pc, e->count);
+  }
+  if (dropped > 0)
+    fprintf(stderr, "c0vm: %d samples dropped, too many distinct stacks\n",
+            (int)dropped);
+
+  fclose(out);
+  profile_free_names(names, function_count);
+  free(table);
+}
+
+void sample_init(struct bc0_file *bc0, char *filename, int hz) {
+  REQUIRES(bc0 != NULL && filename != NULL);
+
+  if (hz <= 0 || hz > 1000000) {
+    fprintf(stderr, "Error: invalid sampling frequency %d\n", hz);
+    exit(EXIT_FAILURE);
+  }
+  out = fopen(filename, "w");
+  if (out == NULL) {
+    perror("Couldn't open $C0_SAMPLE");
+    exit(EXIT_FAILURE);
+  }
+  function_count = bc0->function_count;
+  names = profile_copy_names(bc0);
+  table = xcalloc(TABLE_SIZE, sizeof(struct stack_entry));
+  c0_sampling = true;
+  atexit(sample_report);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0) {
+    perror("Couldn't handle SIGPROF for $C0_SAMPLE");
+    exit(EXIT_FAILURE);
+  }
+
+  /* tv_usec must be under a second, which it isn't at 1 Hz */
+  long period = 1000000 / hz;
+  struct itimerval every;
+  every.it_interval.tv_sec = period / 1000000;
+  every.it_interval.tv_usec = period % 1000000;
+  every.it_value = every.it_interval;
+  if (setitimer(ITIMER_PROF, &every, NULL) != 0) {
+    perror("Couldn't start the $C0_SAMPLE timer");
+    exit(EXIT_FAILURE);
+  }
+}
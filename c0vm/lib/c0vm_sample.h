@@ -0,0 +1,24 @@
+/* C0VM sampling profiler
+ *
+ * A profiling timer periodically records the C0 call stack and pc.
+ * At exit the samples are written in the collapsed-stack format read
+ * by flame graph tools, one "main;f;g;@pc count" line per distinct
+ * stack.  Enabled by setting C0_SAMPLE to the output file; C0_SAMPLE_HZ
+ * sets the sampling frequency (default 997 Hz).
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_SAMPLE_H_
+#define _C0VM_SAMPLE_H_
+
+extern bool c0_sampling;  /* true once sample_init has been called */
+
+void sample_init(struct bc0_file *bc0, char *filename, int hz);
+
+void sample_pc(size_t pc);     /* before executing each instruction */
+void sample_call(size_t fn);   /* on entry to function_pool[fn] */
+void sample_return(void);      /* on return from the current function */
+
+#endif /* _C0VM_SAMPLE_H_ */
@@ -0,0 +1,343 @@
+/* C0VM scheduler
+ *
+ * Each worker's run queue is a ring buffer under its own lock, which is
+ * only contended when another thread steals from it or hands it a
+ * context back from the blocking pool.  A worker takes from the front of
+ * its queue and puts preempted contexts at the back, so the contexts it
+ * holds share it round-robin; thieves take from the back.  Idle workers
+ * sleep until the count of queued contexts becomes positive.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_abort.h"
+#include "c0vm_context.h"
+#include "c0vm_sched.h"
+
+struct task {
+  struct c0vm_context *ctx;
+  sched_done_fn *done;
+  void *arg;
+  size_t home;      /* the worker it goes back to after blocking */
+};
+
+struct queue {
+  pthread_mutex_t lock;
+  struct task **items;  /* ring buffer */
+  size_t head;
+  size_t count;
+  size_t cap;
+};
+
+struct worker {
+  struct c0vm_sched *sched;
+  size_t id;
+  struct queue q;
+  pthread_t thread;
+};
+
+struct c0vm_sched {
+  size_t quantum;
+
+  size_t nworkers;
+  struct worker *workers;
+  size_t next_home;     /* round robin for spawn, under idle_lock */
+
+  /* Sleeping workers wait for ready > 0 */
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+  size_t ready;         /* contexts in run queues, atomic */
+  size_t sleepers;      /* atomic */
+
+  /* The blocking pool shares one queue */
+  size_t nblockers;
+  pthread_t *blockers;
+  struct queue blocked;
+  pthread_cond_t blocked_nonempty;
+
+  /* sched_wait waits for live == 0 */
+  pthread_mutex_t live_lock;
+  pthread_cond_t all_done;
+  size_t live;
+
+  bool shutdown;        /* atomic */
+};
+
+/*** Queues ***/
+
+static void queue_init(struct queue *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  q->cap = 16;
+  q->items = xcalloc(q->cap, sizeof(struct task *));
+  q->head = 0;
+  q->count = 0;
+}
+
+static void queue_destroy(struct queue *q) {
+  pthread_mutex_destroy(&q->lock);
+  free(q->items);
+}
+
+/* The caller holds q->lock for these */
+
+static void queue_push_back(struct queue *q, struct task *t) {
+  if (q->count == q->cap) {
+    struct task **bigger = xcalloc(2 * q->cap, sizeof(struct task *));
+    for (size_t i = 0; i < q->count; i++)
+      bigger[i] = q->items[(q->head + i) % q->cap];
+    free(q->items);
+    q->items = bigger;
+    q->head = 0;
+    q->cap *= 2;
+  }
+  q->items[(q->head + q->count) % q->cap] = t;
+  q->count++;
+}
+
+static struct task *queue_pop_front(struct queue *q) {
+  if (q->count == 0) return NULL;
+  struct task *t = q->items[q->head];
+  q->head = (q->head + 1) % q->cap;
+  q->count--;
+  return t;
+}
+
+static struct task *queue_pop_back(struct queue *q) {
+  if (q->count == 0) return NULL;
+  q->count--;
+  return q->items[(q->head + q->count) % q->cap];
+}
+
+/*** Run queues ***/
+
+static void make_ready(struct c0vm_sched *s, size_t w, struct task *t) {
+  struct queue *q = &s->workers[w].q;
+  pthread_mutex_lock(&q->lock);
+  queue_push_back(q, t);
+  pthread_mutex_unlock(&q->lock);
+
+  __atomic_add_fetch(&s->ready, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&s->idle_lock);
+    pthread_cond_signal(&s->idle);
+    pthread_mutex_unlock(&s->idle_lock);
+  }
+}
+
+static struct task *take(struct worker *w) {
+  struct c0vm_sched *s = w->sched;
+  struct task *t;
+
+  pthread_mutex_lock(&w->q.lock);
+  t = queue_pop_front(&w->q);
+  pthread_mutex_unlock(&w->q.lock);
+
+  for (size_t i = 1; t == NULL && i < s->nworkers; i++) {
+    struct queue *victim = &s->workers[(w->id + i) % s->nworkers].q;
+    pthread_mutex_lock(&victim->lock);
+    t = queue_pop_back(victim);
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  if (t != NULL) __atomic_sub_fetch(&s->ready, 1, __ATOMIC_SEQ_CST);
+  return t;
+}
+
+/* NULL once the scheduler shuts down */
+static struct task *next_task(struct worker *w) {
+  struct c0vm_sched *s = w->sched;
+  while (true) {
+    struct task *t = take(w);
+    if (t != NULL) return t;
+
+    pthread_mutex_lock(&s->idle_lock);
+    __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&s->ready, __ATOMIC_SEQ_CST) == 0
+           && !__atomic_load_n(&s->shutdown, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&s->idle, &s->idle_lock);
+    __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+    bool stop = __atomic_load_n(&s->shutdown, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&s->idle_lock);
+    if (stop) return NULL;
+  }
+}
+
+/*** Running ***/
+
+static void finish(struct c0vm_sched *s, struct task *t, const char *error) {
+  t->done(t->ctx, t->ctx->result.payload.i, error, t->arg);  /* main's int */
+  free(t);
+
+  pthread_mutex_lock(&s->live_lock);
+  if (--s->live == 0) pthread_cond_broadcast(&s->all_done);
+  pthread_mutex_unlock(&s->live_lock);
+}
+
+static void fail(struct c0vm_sched *s, struct task *t,
+                 struct c0_error_trap *trap) {
+  char error[sizeof(trap->message) + 64];
+  snprintf(error, sizeof(error), "%s: %s", trap->kind, trap->message);
+  finish(s, t, error);
+}
+
+/* Runs one quantum of t, or its pending native.  Returns C0VM_DONE if t
+ * stopped with an error, which has already been reported. */
+static enum c0vm_status run(struct c0vm_sched *s, struct task *t,
+                            bool native) {
+  struct c0_error_trap trap;
+  volatile enum c0vm_status status = C0VM_DONE;
+
+  c0_set_error_trap(&trap);
+  if (setjmp(trap.env) == 0) {
+    if (native) {
+      complete_native(t->ctx);
+      status = C0VM_YIELDED;
+    } else {
+      status = execute_quantum(t->ctx, s->quantum);
+      if (status == C0VM_DONE) finish(s, t, NULL);
+    }
+  } else {
+    fail(s, t, &trap);
+  }
+  c0_set_error_trap(NULL);
+  return status;
+}
+
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  struct c0vm_sched *s = w->sched;
+  struct task *t;
+  while ((t = next_task(w)) != NULL) {
+    switch (run(s, t, false)) {
+    case C0VM_DONE:
+      break;
+    case C0VM_YIELDED:
+      make_ready(s, w->id, t);
+      break;
+    case C0VM_BLOCKED:
+      t->home = w->id;
+      pthread_mutex_lock(&s->blocked.lock);
+      queue_push_back(&s->blocked, t);
+      pthread_cond_signal(&s->blocked_nonempty);
+      pthread_mutex_unlock(&s->blocked.lock);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void *blocker_main(void *arg) {
+  struct c0vm_sched *s = arg;
+  while (true) {
+    pthread_mutex_lock(&s->blocked.lock);
+    while (s->blocked.count == 0
+           && !__atomic_load_n(&s->shutdown, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&s->blocked_nonempty, &s->blocked.lock);
+    struct task *t = queue_pop_front(&s->blocked);
+    pthread_mutex_unlock(&s->blocked.lock);
+    if (t == NULL) return NULL;
+
+    if (run(s, t, true) != C0VM_DONE) make_ready(s, t->home, t);
+  }
+}
+
+/*** Interface ***/
+
+static void start(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  if (pthread_create(thread, NULL, fn, arg) != 0) {
+    perror("pthread_create");
+    exit(EXIT_FAILURE);
+  }
+}
+
+struct c0vm_sched *sched_new(size_t workers, size_t blockers, size_t quantum) {
+  REQUIRES(workers > 0 && blockers > 0);
+
+  struct c0vm_sched *s = xcalloc(1, sizeof(struct c0vm_sched));
+  s->quantum = quantum;
+  pthread_mutex_init(&s->idle_lock, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  pthread_mutex_init(&s->live_lock, NULL);
+  pthread_cond_init(&s->all_done, NULL);
+  queue_init(&s->blocked);
+  pthread_cond_init(&s->blocked_nonempty, NULL);
+
+  s->nworkers = workers;
+  s->workers = xcalloc(workers, sizeof(struct worker));
+  for (size_t i = 0; i < workers; i++) {
+    s->workers[i].sched = s;
+    s->workers[i].id = i;
+    queue_init(&s->workers[i].q);
+  }
+  for (size_t i = 0; i < workers; i++)
+    start(&s->workers[i].thread, worker_main, &s->workers[i]);
+
+  s->nblockers = blockers;
+  s->blockers = xcalloc(blockers, sizeof(pthread_t));
+  for (size_t i = 0; i < blockers; i++)
+    start(&s->blockers[i], blocker_main, s);
+  return s;
+}
+
+void sched_spawn(struct c0vm_sched *s, struct c0vm_context *ctx,
+                 sched_done_fn *done, void *arg) {
+  REQUIRES(s != NULL && ctx != NULL && done != NULL);
+
+  struct task *t = xmalloc(sizeof(struct task));
+  t->ctx = ctx;
+  t->done = done;
+  t->arg = arg;
+  ctx->defer_blocking = true;
+
+  pthread_mutex_lock(&s->live_lock);
+  s->live++;
+  pthread_mutex_unlock(&s->live_lock);
+
+  pthread_mutex_lock(&s->idle_lock);
+  t->home = s->next_home;
+  s->next_home = (s->next_home + 1) % s->nworkers;
+  pthread_mutex_unlock(&s->idle_lock);
+  make_ready(s, t->home, t);
+}
+
+void sched_wait(struct c0vm_sched *s) {
+  REQUIRES(s != NULL);
+
+  pthread_mutex_lock(&s->live_lock);
+  while (s->live > 0) pthread_cond_wait(&s->all_done, &s->live_lock);
+  pthread_mutex_unlock(&s->live_lock);
+}
+
+void sched_free(struct c0vm_sched *s) {
+  REQUIRES(s != NULL);
+
+  pthread_mutex_lock(&s->idle_lock);
+  __atomic_store_n(&s->shutdown, true, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&s->idle);
+  pthread_mutex_unlock(&s->idle_lock);
+  pthread_mutex_lock(&s->blocked.lock);
+  pthread_cond_broadcast(&s->blocked_nonempty);
+  pthread_mutex_unlock(&s->blocked.lock);
+
+  for (size_t i = 0; i < s->nworkers; i++)
+    pthread_join(s->workers[i].thread, NULL);
+  for (size_t i = 0; i < s->nblockers; i++)
+    pthread_join(s->blockers[i], NULL);
+
+  for (size_t i = 0; i < s->nworkers; i++) queue_destroy(&s->workers[i].q);
+  queue_destroy(&s->blocked);
+  pthread_mutex_destroy(&s->idle_lock);
+  pthread_cond_destroy(&s->idle);
+  pthread_mutex_destroy(&s->live_lock);
+  pthread_cond_destroy(&s->all_done);
+  pthread_cond_destroy(&s->blocked_nonempty);
+  free(s->workers);
+  free(s->blockers);
+  free(s);
+}
@@ -0,0 +1,36 @@
+/* C0VM scheduler
+ *
+ * Runs many contexts on a few threads.  Each worker thread runs the
+ * contexts in its own run queue a quantum at a time (see
+ * execute_quantum), putting preempted ones at the back; a worker whose
+ * queue is empty steals from the others.  Natives that may block are
+ * handed to a separate pool of threads so they never hold up a worker.
+ */
+
+#include <stddef.h>
+#include "c0vm_context.h"
+
+#ifndef _C0VM_SCHED_H_
+#define _C0VM_SCHED_H_
+
+struct c0vm_sched;
+
+/* Called on a worker thread when ctx finishes.  error is NULL if main
+ * returned result, and describes the C0 error that stopped it otherwise.
+ * The scheduler is done with ctx; the callback may free it. */
+typedef void sched_done_fn(struct c0vm_context *ctx, int result,
+                           const char *error, void *arg);
+
+struct c0vm_sched *sched_new(size_t workers, size_t blockers, size_t quantum);
+
+/* Start running ctx; any thread may spawn, including callbacks */
+void sched_spawn(struct c0vm_sched *s, struct c0vm_context *ctx,
+                 sched_done_fn *done, void *arg);
+
+/* Wait until every spawned context has finished */
+void sched_wait(struct c0vm_sched *s);
+
+/* Stops the threads; call after sched_wait */
+void sched_free(struct c0vm_sched *s);
+
+#endif /* _C0VM_SCHED_H_ */
@@ -0,0 +1,314 @@
+/* C0VM fork server
+ *
+ * A request is a 4-byte length followed by that many bytes of
+ * NUL-terminated strings: the working directory, then argv.  The
+ * client's stdin, stdout and stderr ride along with the length as
+ * SCM_RIGHTS.  The server keeps each connection open until it reaps the
+ * child serving it, then writes back the 4-byte wait status.  Children
+ * are reaped from the poll loop, woken by a SIGCHLD self-pipe.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm_server.h"
+
+#define MAX_REQUEST (1 << 20)
+
+struct running {
+  pid_t pid;
+  int conn;
+};
+
+static int sigchld_pipe[2];
+
+static void on_sigchld(int sig) {
+  (void)sig;
+  int saved = errno;
+  char c = 0;
+  if (write(sigchld_pipe[1], &c, 1) < 0) { /* already has a wakeup */ }
+  errno = saved;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static struct sockaddr_un address(const char *socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error: socket path too long: %s\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, socket_path);
+  return addr;
+}
+
+/*** Server ***/
+
+/* Reads a request, filling fds[3]; returns the strings or NULL */
+static char *receive(int conn, int fds[3], uint32_t *len) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  struct iovec iov = { len, sizeof(*len) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n = recvmsg(conn, &msg, 0);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+      || c->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return NULL;
+  memcpy(fds, CMSG_DATA(c), 3 * sizeof(int));
+  if (n < (ssize_t)sizeof(*len)
+      || *len == 0 || *len > MAX_REQUEST) {
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    return NULL;
+  }
+
+  char *strings = xmalloc(*len + 1);
+  if (!read_all(conn, strings, *len)) {
+    free(strings);
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    return NULL;
+  }
+  strings[*len] = '\0';
+  return strings;
+}
+
+/* In the child: become the client's process and run its program.  The
+ * connections of the other requests still running are closed here, so
+ * their clients see EOF if the server dies, not when this child exits. */
+static void serve(int conn, int listener, struct running *live, size_t nlive,
+                  server_run_fn *run) {
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  close(sigchld_pipe[0]);
+  close(sigchld_pipe[1]);
+  close(listener);
+  for (size_t i = 0; i < nlive; i++) close(live[i].conn);
+  free(live);
+
+  int fds[3];
+  uint32_t len;
+  char *strings = receive(conn, fds, &len);
+  close(conn);
+  if (strings == NULL) _exit(EXIT_FAILURE);
+  for (int i = 0; i < 3; i++) {
+    if (dup2(fds[i], i) < 0) _exit(EXIT_FAILURE);
+    close(fds[i]);
+  }
+
+  /* cwd, then argv */
+  int argc = -1;
+  for (uint32_t i = 0; i < len; i++)
+    if (strings[i] == '\0') argc++;
+  if (argc < 1) {
+    fprintf(stderr, "c0vm: malformed request\n");
+    exit(EXIT_FAILURE);
+  }
+  char **argv = xcalloc(argc + 1, sizeof(char *));
+  char *s = strings + strlen(strings) + 1;
+  for (int i = 0; i < argc; i++) {
+    argv[i] = s;
+    s += strlen(s) + 1;
+  }
+  if (chdir(strings) != 0) die(strings);
+
+  exit(run(argc, argv));
+}
+
+static void reap(struct running *live, size_t *nlive) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (size_t i = 0; i < *nlive; i++) {
+      if (live[i].pid != pid) continue;
+      int32_t reply = status;
+      write_all(live[i].conn, &reply, sizeof(reply));
+      close(live[i].conn);
+      live[i] = live[--*nlive];
+      break;
+    }
+  }
+}
+
+void fork_server(const char *socket_path, server_run_fn *run) {
+  REQUIRES(socket_path != NULL && run != NULL);
+
+  if (pipe(sigchld_pipe) != 0) die("pipe");
+  fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigchld;
+  sa.sa_flags = SA_NOCLDSTOP;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGCHLD, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) die("socket");
+  struct sockaddr_un addr = address(socket_path);
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    die(socket_path);
+  if (listen(listener, 128) != 0) die("listen");
+  fprintf(stderr, "c0vm: serving on %s\n", socket_path);
+
+  size_t cap = 64, nlive = 0;
+  struct running *live = xcalloc(cap, sizeof(struct running));
+
+  while (true) {
+    struct pollfd p[2] = {
+      { listener, POLLIN, 0 },
+      { sigchld_pipe[0], POLLIN, 0 },
+    };
+    if (poll(p, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    if (p[1].revents & POLLIN) {
+      char buf[64];
+      while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) continue;
+      reap(live, &nlive);
+    }
+
+    if (!(p[0].revents & POLLIN)) continue;
+    int conn = accept(listener, NULL, NULL);
+    if (conn < 0) continue;
+
+    fflush(NULL);  /* nothing buffered should be written twice */
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      close(conn);
+      continue;
+    }
+    if (pid == 0) serve(conn, listener, live, nlive, run);
+
+    if (nlive == cap) {
+      struct running *bigger = xcalloc(2 * cap, sizeof(struct running));
+      memcpy(bigger, live, cap * sizeof(struct running));
+      free(live);
+      live = bigger;
+      cap *= 2;
+    }
+    live[nlive].pid = pid;
+    live[nlive].conn = conn;
+    nlive++;
+  }
+}
+
+/*** Client ***/
+
+int fork_client(const char *socket_path, int argc, char **argv) {
+  REQUIRES(socket_path != NULL && argc >= 1 && argv != NULL);
+
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL) die("getcwd");
+  size_t total = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) total += strlen(argv[i]) + 1;
+  if (total > MAX_REQUEST) {
+    fprintf(stderr, "Error: arguments too long\n");
+    free(cwd);
+    return -1;
+  }
+  char *strings = xmalloc(total);
+  size_t off = 0;
+  strcpy(strings, cwd);
+  off += strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    strcpy(strings + off, argv[i]);
+    off += strlen(argv[i]) + 1;
+  }
+  free(cwd);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr = address(socket_path);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(socket_path);
+    free(strings);
+    return -1;
+  }
+
+  uint32_t len = total;
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  int32_t status;
+  bool ok = sendmsg(sock, &msg, 0) == (ssize_t)sizeof(len)
+         && write_all(sock, strings, total)
+         && read_all(sock, &status, sizeof(status));
+  free(strings);
+  close(sock);
+  if (!ok) {
+    fprintf(stderr, "Error: lost connection to %s\n", socket_path);
+    return -1;
+  }
+  return status;
+}
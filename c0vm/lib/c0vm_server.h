@@ -0,0 +1,27 @@
+/* C0VM fork server
+ *
+ * A resident c0vm that has already paid for dynamic linking, and
+ * possibly for loading a program, serves run requests on a Unix socket
+ * by forking a copy-on-write child for each.  A request carries the
+ * client's working directory, the bc0 file and its arguments, and the
+ * client's standard input, output and error descriptors; the reply is
+ * the child's wait status.
+ */
+
+#ifndef _C0VM_SERVER_H_
+#define _C0VM_SERVER_H_
+
+/* Runs a program in a forked child, whose stdio and working directory are
+ * already the client's.  argv[0] is the bc0 file.  Returns the child's
+ * exit status. */
+typedef int server_run_fn(int argc, char **argv);
+
+/* Serve requests on socket_path until killed */
+void fork_server(const char *socket_path, server_run_fn *run);
+
+/* Send a request with our stdio and working directory and wait for it
+ * to finish.  Returns its wait status, or -1 if the server can't be
+ * reached. */
+int fork_client(const char *socket_path, int argc, char **argv);
+
+#endif /* _C0VM_SERVER_H_ */
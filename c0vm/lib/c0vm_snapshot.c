@@ -0,0 +1,485 @@
+/* C0VM snapshots
+ *
+ * A snapshot file holds, in the host's byte order:
+ *
+ *   header   magic, format version, program hash, argc
+ *   heap     block count, every block's size, then their contents,
+ *            newest first as in ctx->heap
+ *   relocs   count, then (block, offset, pointer) for each heap word
+ *            that holds a pointer
+ *   frames   count, then from main's to the running one: fn, pc,
+ *            locals, and the operand stack's size and values, bottom
+ *            first
+ *   options  count, then the kind, name and pointer of each
+ *   pending  the native the program stopped before and its arguments,
+ *            or NO_NATIVE
+ *
+ * Pointers are written as a region -- a heap block, the string pool or
+ * an argument -- and an offset into it, and point into the same region
+ * wherever it is after the restore.  C0 values say whether they are
+ * pointers, but heap blocks don't, so every aligned word of a block
+ * that points into a region is taken to be one.  Values pointing
+ * anywhere else, like strings the string library made, can't be
+ * written; heap words pointing there are kept as they are and mean
+ * nothing after a restore.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "stack.h"
+#include "c0v_stack.h"
+#include "c0vm_context.h"
+#include "c0vm_coverage.h"
+#include "c0vm_natives.h"
+#include "c0vm_profile.h"
+#include "c0vm_sample.h"
+#include "c0vm_snapshot.h"
+
+#define MAGIC 0x50414e53u  /* "SNAP" */
+#define FORMAT 1
+#define NO_NATIVE 0xFFFFFFFFu
+
+enum region { REGION_NULL, REGION_HEAP, REGION_STRINGS, REGION_ARG };
+
+struct ref {
+  uint32_t region;
+  uint32_t index;
+  uint64_t offset;
+};
+
+struct value {
+  uint32_t kind;
+  int32_t i;
+  struct ref p;
+};
+
+struct reloc {
+  uint32_t block;
+  uint32_t unused;
+  uint64_t offset;
+  struct ref p;
+};
+
+struct block {
+  char *start;
+  size_t size;
+  uint32_t index;
+};
+
+struct snapshot {
+  FILE *f;
+  const char *filename;
+  struct c0vm_context *ctx;
+  struct block *blocks;  /* by address when writing, by index when reading */
+  size_t nblocks;
+};
+
+/*** Writing ***/
+
+/* Removes the partial file, so it can't be mistaken for a snapshot */
+static void write_error(struct snapshot *s, const char *message) {
+  fprintf(stderr, "Error: can't snapshot: %s\n", message);
+  if (s->f != NULL) fclose(s->f);
+  remove(s->filename);
+  exit(EXIT_FAILURE);
+}
+
+static void put(struct snapshot *s, const void *p, size_t n) {
+  if (n > 0 && fwrite(p, n, 1, s->f) != 1) write_error(s, strerror(errno));
+}
+
+static void put_u32(struct snapshot *s, uint32_t x) {
+  put(s, &x, sizeof(x));
+}
+
+static void put_u64(struct snapshot *s, uint64_t x) {
+  put(s, &x, sizeof(x));
+}
+
+static int by_address(const void *x, const void *y) {
+  uintptr_t a = (uintptr_t)((const struct block *)x)->start;
+  uintptr_t b = (uintptr_t)((const struct block *)y)->start;
+  return a < b ? -1 : a > b;
+}
+
+/* The region p points into (or just past), if any */
+static bool find(struct snapshot *s, void *p, struct ref *r) {
+  memset(r, 0, sizeof(*r));
+  if (p == NULL) return true;
+  uintptr_t a = (uintptr_t)p;
+
+  /* the last block starting at or before p */
+  size_t lo = 0, hi = s->nblocks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((uintptr_t)s->blocks[mid].start <= a) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo > 0) {
+    struct block *b = &s->blocks[lo-1];
+    if (a - (uintptr_t)b->start <= b->size) {
+      r->region = REGION_HEAP;
+      r->index = b->index;
+      r->offset = a - (uintptr_t)b->start;
+      return true;
+    }
+  }
+
+  struct bc0_file *bc0 = s->ctx->bc0;
+  uintptr_t pool = (uintptr_t)bc0->string_pool;
+  if (pool <= a && a - pool <= bc0->string_count) {
+    r->region = REGION_STRINGS;
+    r->offset = a - pool;
+    return true;
+  }
+
+  for (int i = 0; i < s->ctx->argc; i++) {
+    uintptr_t arg = (uintptr_t)s->ctx->argv[i];
+    if (arg <= a && a - arg <= strlen(s->ctx->argv[i])) {
+      r->region = REGION_ARG;
+      r->index = i;
+      r->offset = a - arg;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void put_value(struct snapshot *s, c0_value v) {
+  struct value w;
+  memset(&w, 0, sizeof(w));
+  w.kind = v.kind;
+  if (v.kind == C0_INTEGER)
+    w.i = v.payload.i;
+  else if (!find(s, v.payload.p, &w.p))
+    write_error(s, "the program holds memory from outside the C0 heap");
+  put(s, &w, sizeof(w));
+}
+
+static void put_frame(struct snapshot *s, size_t fn, size_t pc,
+                      c0_value *V, c0v_stack_t S) {
+  put_u32(s, fn);
+  put_u64(s, pc);
+  for (size_t i = 0; i < s->ctx->bc0->function_pool[fn].num_vars; i++)
+    put_value(s, V[i]);
+
+  /* S from the bottom, leaving it as it was */
+  size_t n = c0v_stack_size(S);
+  c0_value *vals = xcalloc(n + 1, sizeof(c0_value));
+  for (size_t i = n; i > 0; i--) vals[i-1] = c0v_pop(S);
+  for (size_t i = 0; i < n; i++) c0v_push(S, vals[i]);
+  put_u64(s, n);
+  for (size_t i = 0; i < n; i++) put_value(s, vals[i]);
+  free(vals);
+}
+
+static uint32_t native_args(struct bc0_file *bc0, uint16_t idx) {
+  for (size_t j = 0; j < bc0->native_count; j++)
+    if (bc0->native_pool[j].function_table_index == idx)
+      return bc0->native_pool[j].num_args;
+  return 0;
+}
+
+void snapshot_write(struct c0vm_context *ctx, const char *filename) {
+  REQUIRES(ctx != NULL && filename != NULL);
+  REQUIRES(ctx->started && !ctx->done);
+
+  struct snapshot s = { fopen(filename, "wb"), filename, ctx, NULL, 0 };
+  if (s.f == NULL) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+
+  for (struct c0_allocation *a = ctx->heap; a != NULL; a = a->next)
+    s.nblocks++;
+  s.blocks = xcalloc(s.nblocks + 1, sizeof(struct block));
+  uint32_t k = 0;
+  for (struct c0_allocation *a = ctx->heap; a != NULL; a = a->next, k++) {
+    s.blocks[k].start = (char *)(a + 1);
+    s.blocks[k].size = a->size;
+    s.blocks[k].index = k;
+  }
+
+  put_u32(&s, MAGIC);
+  put_u32(&s, FORMAT);
+  put_u64(&s, program_hash(ctx->bc0));
+  put_u32(&s, ctx->argc);
+
+  put_u64(&s, s.nblocks);
+  for (size_t b = 0; b < s.nblocks; b++) put_u64(&s, s.blocks[b].size);
+  for (size_t b = 0; b < s.nblocks; b++)
+    put(&s, s.blocks[b].start, s.blocks[b].size);
+
+  qsort(s.blocks, s.nblocks, sizeof(struct block), by_address);
+  size_t nrelocs = 0, cap = 64;
+  struct reloc *relocs = xcalloc(cap, sizeof(struct reloc));
+  for (size_t b = 0; b < s.nblocks; b++) {
+    struct block *blk = &s.blocks[b];
+    for (size_t off = 0; off + sizeof(void *) <= blk->size;
+         off += sizeof(void *)) {
+      void *p;
+      struct ref r;
+      memcpy(&p, blk->start + off, sizeof(p));
+      if (p == NULL || !find(&s, p, &r)) continue;
+      if (nrelocs == cap) {
+        struct reloc *bigger = xcalloc(2 * cap, sizeof(struct reloc));
+        memcpy(bigger, relocs, cap * sizeof(struct reloc));
+        free(relocs);
+        relocs = bigger;
+        cap *= 2;
+      }
+      relocs[nrelocs].block = blk->index;
+      relocs[nrelocs].unused = 0;
+      relocs[nrelocs].offset = off;
+      relocs[nrelocs].p = r;
+      nrelocs++;
+    }
+  }
+  put_u64(&s, nrelocs);
+  put(&s, relocs, nrelocs * sizeof(struct reloc));
+  free(relocs);
+
+  /* The call stack from the bottom, leaving it as it was */
+  size_t depth = stack_size(ctx->call_stack);
+  struct c0vm_frame **frames = xcalloc(depth + 1, sizeof(struct c0vm_frame *));
+  for (size_t i = depth; i > 0; i--) frames[i-1] = pop(ctx->call_stack);
+  for (size_t i = 0; i < depth; i++) push(ctx->call_stack, frames[i]);
+  put_u64(&s, depth + 1);
+  for (size_t i = 0; i < depth; i++)
+    put_frame(&s, frames[i]->fn, frames[i]->pc, frames[i]->V, frames[i]->S);
+  put_frame(&s, ctx->fn, ctx->pc, ctx->V, ctx->S);
+  free(frames);
+
+  uint32_t noptions = 0;
+  for (struct c0vm_option *o = ctx->options; o != NULL; o = o->next)
+    noptions++;
+  put_u32(&s, noptions);
+  for (struct c0vm_option *o = ctx->options; o != NULL; o = o->next) {
+    put_u32(&s, o->kind);
+    put_u32(&s, strlen(o->name));
+    put(&s, o->name, strlen(o->name));
+    put_value(&s, ptr2val(o->ptr));
+  }
+
+  if (ctx->pending_args == NULL) {
+    put_u32(&s, NO_NATIVE);
+  } else {
+    uint32_t nargs = native_args(ctx->bc0, ctx->pending_native);
+    put_u32(&s, ctx->pending_native);
+    put_u32(&s, nargs);
+    for (uint32_t i = 0; i < nargs; i++) put_value(&s, ctx->pending_args[i]);
+  }
+
+  free(s.blocks);
+  int closed = fclose(s.f);
+  s.f = NULL;
+  if (closed != 0) write_error(&s, strerror(errno));
+}
+
+void snapshot_take(struct c0vm_context *ctx, const char *at,
+                   const char *filename) {
+  REQUIRES(ctx != NULL && at != NULL && filename != NULL);
+  REQUIRES(!ctx->started);
+
+  enum c0vm_status status;
+  char *end;
+  unsigned long long n = strtoull(at, &end, 10);
+  if (*at != '\0' && *end == '\0' && n > 0) {
+    status = execute_quantum(ctx, n);
+  } else {
+    int idx = native_lookup(at);
+    if (idx < 0) {
+      fprintf(stderr, "Error: C0_SNAPSHOT_AT: no native called %s\n", at);
+      exit(EXIT_FAILURE);
+    }
+    bool intrinsics = ctx->intrinsics;
+    ctx->intrinsics = false;  /* they wouldn't stop */
+    ctx->stop_native = idx;
+    while ((status = execute_quantum(ctx, 0)) == C0VM_BLOCKED
+           && ctx->pending_native != idx)
+      complete_native(ctx);
+    ctx->stop_native = -1;
+    ctx->intrinsics = intrinsics;
+  }
+
+  if (status == C0VM_DONE) {
+    fprintf(stderr, "c0vm: program finished before %s, no snapshot taken\n",
+            at);
+    return;
+  }
+  snapshot_write(ctx, filename);
+}
+
+/*** Restoring ***/
+
+static void read_error(struct snapshot *s, const char *message) {
+  fprintf(stderr, "Error: %s: %s\n", s->filename, message);
+  exit(EXIT_FAILURE);
+}
+
+static void get(struct snapshot *s, void *p, size_t n) {
+  if (n > 0 && fread(p, n, 1, s->f) != 1)
+    read_error(s, "truncated snapshot");
+}
+
+static uint32_t get_u32(struct snapshot *s) {
+  uint32_t x;
+  get(s, &x, sizeof(x));
+  return x;
+}
+
+static uint64_t get_u64(struct snapshot *s) {
+  uint64_t x;
+  get(s, &x, sizeof(x));
+  return x;
+}
+
+static void *pointer(struct snapshot *s, struct ref r) {
+  char *base = NULL;
+  size_t limit = 0;
+  switch (r.region) {
+  case REGION_NULL:
+    return NULL;
+  case REGION_HEAP:
+    if (r.index < s->nblocks) {
+      base = s->blocks[r.index].start;
+      limit = s->blocks[r.index].size;
+    }
+    break;
+  case REGION_STRINGS:
+    base = s->ctx->bc0->string_pool;
+    limit = s->ctx->bc0->string_count;
+    break;
+  case REGION_ARG:
+    if (r.index < (uint32_t)s->ctx->argc) {
+      base = s->ctx->argv[r.index];
+      limit = strlen(base);
+    }
+    break;
+  }
+  if (base == NULL || r.offset > limit) read_error(s, "bad pointer");
+  return base + r.offset;
+}
+
+static c0_value get_value(struct snapshot *s) {
+  struct value w;
+  get(s, &w, sizeof(w));
+  if (w.kind == C0_INTEGER) return int2val(w.i);
+  if (w.kind != C0_POINTER) read_error(s, "bad value");
+  return ptr2val(pointer(s, w.p));
+}
+
+static void get_frame(struct snapshot *s, struct c0vm_frame *f) {
+  struct bc0_file *bc0 = s->ctx->bc0;
+  f->fn = get_u32(s);
+  if (f->fn >= bc0->function_count) read_error(s, "bad function");
+  struct function_info *finfo = &bc0->function_pool[f->fn];
+  f->P = finfo->code;
+  f->pc = get_u64(s);
+  if (f->pc >= finfo->code_length) read_error(s, "bad pc");
+  f->V = xcalloc(finfo->num_vars + 1, sizeof(c0_value));
+  for (size_t i = 0; i < finfo->num_vars; i++) f->V[i] = get_value(s);
+  f->S = c0v_stack_new();
+  for (uint64_t n = get_u64(s); n > 0; n--) c0v_push(f->S, get_value(s));
+}
+
+void snapshot_restore(struct c0vm_context *ctx, const char *filename) {
+  REQUIRES(ctx != NULL && filename != NULL);
+  REQUIRES(!ctx->started && ctx->heap == NULL);
+  REQUIRES(stack_empty(ctx->call_stack));
+
+  struct snapshot s = { fopen(filename, "rb"), filename, ctx, NULL, 0 };
+  if (s.f == NULL) {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+
+  if (get_u32(&s) != MAGIC || get_u32(&s) != FORMAT)
+    read_error(&s, "not a c0vm snapshot");
+  if (get_u64(&s) != program_hash(ctx->bc0))
+    read_error(&s, "snapshot of a different program");
+  if (get_u32(&s) != (uint32_t)ctx->argc)
+    read_error(&s, "snapshot taken with a different number of arguments");
+
+  /* Oldest first, so that ctx->heap lists them in the same order */
+  s.nblocks = get_u64(&s);
+  uint64_t *sizes = xcalloc(s.nblocks + 1, sizeof(uint64_t));
+  get(&s, sizes, s.nblocks * sizeof(uint64_t));
+  s.blocks = xcalloc(s.nblocks + 1, sizeof(struct block));
+  for (size_t b = s.nblocks; b > 0; b--) {
+    s.blocks[b-1].start = c0vm_alloc(ctx, sizes[b-1]);
+    s.blocks[b-1].size = sizes[b-1];
+    s.blocks[b-1].index = b-1;
+  }
+  free(sizes);
+  for (size_t b = 0; b < s.nblocks; b++)
+    get(&s, s.blocks[b].start, s.blocks[b].size);
+
+  for (uint64_t n = get_u64(&s); n > 0; n--) {
+    struct reloc r;
+    get(&s, &r, sizeof(r));
+    if (r.block >= s.nblocks
+        || r.offset + sizeof(void *) > s.blocks[r.block].size)
+      read_error(&s, "bad relocation");
+    void *p = pointer(&s, r.p);
+    memcpy(s.blocks[r.block].start + r.offset, &p, sizeof(p));
+  }
+
+  uint64_t depth = get_u64(&s);
+  if (depth == 0) read_error(&s, "no frames");
+  for (uint64_t i = 0; i < depth; i++) {
+    struct c0vm_frame *f = xmalloc(sizeof(struct c0vm_frame));
+    get_frame(&s, f);
+    if (c0_profiling) profile_call(f->fn);
+    if (c0_sampling) sample_call(f->fn);
+    if (i + 1 < depth) {
+      push(ctx->call_stack, f);
+    } else {
+      c0v_stack_free(ctx->S);
+      free(ctx->V);
+      ctx->S = f->S;
+      ctx->fn = f->fn;
+      ctx->P = f->P;
+      ctx->pc = f->pc;
+      ctx->V = f->V;
+      free(f);
+    }
+  }
+  ctx->started = true;
+
+  uint32_t noptions = get_u32(&s);
+  struct c0vm_option **options =
+    xcalloc(noptions + 1, sizeof(struct c0vm_option *));
+  for (uint32_t i = 0; i < noptions; i++) {
+    struct c0vm_option *o = xmalloc(sizeof(struct c0vm_option));
+    o->kind = get_u32(&s);
+    uint32_t len = get_u32(&s);
+    o->name = c0vm_alloc(ctx, len + 1);
+    get(&s, o->name, len);
+    o->ptr = val2ptr(get_value(&s));
+    options[i] = o;
+  }
+  for (uint32_t i = noptions; i > 0; i--) {
+    options[i-1]->next = ctx->options;
+    ctx->options = options[i-1];
+  }
+  free(options);
+
+  uint32_t idx = get_u32(&s);
+  if (idx != NO_NATIVE) {
+    if (idx >= NATIVE_FUNCTION_COUNT) read_error(&s, "bad native");
+    uint32_t nargs = get_u32(&s);
+    ctx->pending_native = idx;
+    ctx->pending_args = xcalloc(nargs + 1, sizeof(c0_value));
+    for (uint32_t i = 0; i < nargs; i++)
+      ctx->pending_args[i] = get_value(&s);
+  }
+
+  free(s.blocks);
+  fclose(s.f);
+}
@@ -0,0 +1,36 @@
+/* C0VM snapshots
+ *
+ * Setting C0_SNAPSHOT to a file and C0_SNAPSHOT_AT to a point in the
+ * program writes everything the program has built up by then -- its
+ * heap, operand stacks, locals and call stack -- to the file, after
+ * which the run goes on as usual.  A later run of the same program with
+ * C0_RESTORE set to the file starts from that point instead of from
+ * main, skipping the work it took to get there.
+ *
+ * The point is a native's name, like readline, to stop just before the
+ * program first calls it, or a number of calls and back-edges (the unit
+ * of execute_quantum).  Stopping at a native is the way to mark a point
+ * in the program itself; the native runs after the restore, so that,
+ * for example, each restored run reads its own input.  Open files and
+ * what was already read or written are not part of a snapshot.
+ */
+
+#include "c0vm.h"
+#include "c0vm_context.h"
+
+#ifndef _C0VM_SNAPSHOT_H_
+#define _C0VM_SNAPSHOT_H_
+
+/* Run ctx up to the point at and write its snapshot to filename;
+ * execute(ctx) then goes on from there.  Writes nothing if the program
+ * finishes first. */
+void snapshot_take(struct c0vm_context *ctx, const char *at,
+                   const char *filename);
+
+void snapshot_write(struct c0vm_context *ctx, const char *filename);
+
+/* Load a snapshot into ctx, which must be new and made for the same
+ * program and number of arguments; exits if the snapshot doesn't fit */
+void snapshot_restore(struct c0vm_context *ctx, const char *filename);
+
+#endif /* _C0VM_SNAPSHOT_H_ */
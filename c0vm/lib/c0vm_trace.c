@@ -0,0 +1,121 @@
+/* C0VM execution trace
+ *
+ * The ring buffer is dumped with open/write only, so that the same code
+ * can run from the SIGUSR1 handler and from the handlers for the
+ * signals c0vm_abort.c raises on C0 errors.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xalloc.h"
+#include "contracts.h"
+#include "c0vm.h"
+#include "c0vm_trace.h"
+
+bool c0_tracing = false;
+
+static char *trace_file;
+static struct trace_record *ring;
+static size_t mask;            /* ring size - 1, ring size a power of 2 */
+static volatile uint64_t next; /* records traced so far */
+
+void trace_insn(size_t fn, size_t pc, ubyte opcode,
+                size_t stack_depth, size_t call_depth) {
+  struct trace_record *r = &ring[next & mask];
+  r->fn = fn;
+  r->pc = pc;
+  r->opcode = opcode;
+  r->reserved = 0;
+  r->call_depth = call_depth < UINT16_MAX ? call_depth : UINT16_MAX;
+  r->stack_depth = stack_depth < UINT32_MAX ? stack_depth : UINT32_MAX;
+  next++;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+/* Async-signal-safe */
+static void trace_dump(void) {
+  uint64_t total = next;
+  size_t size = mask + 1;
+  size_t count = total < size ? total : size;
+  size_t first = (total - count) & mask;  /* oldest record */
+
+  struct trace_header h;
+  h.magic = TRACE_MAGIC;
+  h.version = TRACE_VERSION;
+  h.record_size = sizeof(struct trace_record);
+  h.count = count;
+  h.total = total;
+
+  int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  size_t tail = first + count <= size ? count : size - first;
+  if (write_all(fd, &h, sizeof(h))
+      && write_all(fd, &ring[first], tail * sizeof(struct trace_record)))
+    write_all(fd, &ring[0], (count - tail) * sizeof(struct trace_record));
+  close(fd);
+}
+
+static void on_dump_request(int sig) {
+  (void)sig;
+  trace_dump();
+}
+
+/* Installed with SA_RESETHAND, so re-raising terminates as before */
+static void on_fatal(int sig) {
+  trace_dump();
+  raise(sig);
+}
+
+static void exit_dump(void) {
+  trace_dump();
+}
+
+void trace_init(char *filename, size_t records) {
+  REQUIRES(filename != NULL);
+
+  size_t size = 1;
+  while (size < records) size *= 2;
+  ring = xcalloc(size, sizeof(struct trace_record));
+  mask = size - 1;
+  trace_file = filename;
+
+  /* Fail now rather than when it's time to dump */
+  int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Couldn't open $C0_TRACE");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = on_dump_request;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  sa.sa_handler = on_fatal;
+  sa.sa_flags = SA_RESETHAND;
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGABRT, &sa, NULL);
+  sigaction(SIGFPE, &sa, NULL);
+
+  atexit(exit_dump);
+  c0_tracing = true;
+}
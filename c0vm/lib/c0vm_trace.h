@@ -0,0 +1,46 @@
+/* C0VM execution trace
+ *
+ * Each executed instruction is recorded as a fixed-size binary record
+ * in an in-memory ring buffer holding the most recent ones.  The buffer
+ * is written to the trace file when the program exits or aborts, or on
+ * demand when the process receives SIGUSR1.  Enabled by setting
+ * C0_TRACE to the trace file; C0_TRACE_SIZE sets the number of records
+ * kept (rounded up to a power of 2, default 1M).  Decode trace files
+ * with c0vm-trace.
+ */
+
+#include <stdbool.h>
+#include "c0vm.h"
+
+#ifndef _C0VM_TRACE_H_
+#define _C0VM_TRACE_H_
+
+#define TRACE_MAGIC 0x52543043  /* "C0TR" */
+#define TRACE_VERSION 1
+
+/* File layout: a header, then header.count records, oldest first */
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t count;        /* records in this file */
+  uint64_t total;        /* records ever traced; the file has the last ones */
+};
+
+struct trace_record {
+  uint16_t fn;           /* index into function_pool */
+  uint16_t pc;
+  uint8_t opcode;
+  uint8_t reserved;
+  uint16_t call_depth;   /* saturates at UINT16_MAX */
+  uint32_t stack_depth;  /* operand stack size before the instruction */
+};
+
+extern bool c0_tracing;  /* true once trace_init has been called */
+
+void trace_init(char *filename, size_t records);
+
+void trace_insn(size_t fn, size_t pc, ubyte opcode,
+                size_t stack_depth, size_t call_depth);
+
+#endif /* _C0VM_TRACE_H_ */
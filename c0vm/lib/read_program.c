@@ -29,24 +29,36 @@ static inline bool parse_hex(int c, uint8_t *p) {
   return true;
 }
 
+/* Longest #<name> comment kept; cc0 puts one before each function */
+#define LABEL_MAX 256
+
 /* Read a byte from a file
  * 
  * SUCCESSFUL BYTE PARSE: return true, *b = byte
  * END OF FILE: return false, *s = NULL
- * ERROR: return false *s = non-null string (client must free) */
-static inline bool next_byte(FILE *F, uint8_t *b, char **s) {
-  REQUIRES(F != NULL && b != NULL && s != NULL);
+ * ERROR: return false *s = non-null string (client must free)
+ * A #<name> comment passed on the way is copied to label */
+static inline bool next_byte(FILE *F, char *label, uint8_t *b, char **s) {
+  REQUIRES(F != NULL && label != NULL && b != NULL && s != NULL);
 
   // Scan for the first character
   int c;
   do {
     c = fgetc(F);
 
-    // Advance over linecomments
+    // Advance over linecomments, remembering #<name> labels
     if (c == '#') {
-      do { 
+      c = fgetc(F);
+      if (c == '<') {
+        size_t len = 0;
+        while ((c = fgetc(F)) != '>' && c != '\n' && c != EOF
+               && len < LABEL_MAX - 1)
+          label[len++] = c;
+        label[len] = '\0';
+      }
+      while (c != '\n' && c != EOF) {
         c = fgetc(F);
-      } while (c != '\n' && c != EOF);
+      }
     }
 
   } while (isspace(c));
@@ -84,12 +96,14 @@ static inline bool next_byte(FILE *F, uint8_t *b, char **s) {
 }
 
 /* Read in various integer types from the file, possibly aborting program */
-uint32_t read_u32(FILE *F) {
+uint32_t read_u32(FILE *F, char *label) {
   REQUIRES(F != NULL);
   uint8_t x[4];
   char* errmsg;
-  if (!next_byte(F, x, &errmsg) || !next_byte(F, x+1, &errmsg) ||
-      !next_byte(F, x+2, &errmsg) || !next_byte(F, x+3, &errmsg)) {
+  if (!next_byte(F, label, x, &errmsg) ||
+      !next_byte(F, label, x+1, &errmsg) ||
+      !next_byte(F, label, x+2, &errmsg) ||
+      !next_byte(F, label, x+3, &errmsg)) {
     if (errmsg == NULL) {
       fprintf(stderr, "Expected 4-byte sequence, found end of file.\n");
     } else {
@@ -106,11 +120,11 @@ uint32_t read_u32(FILE *F) {
     ((uint32_t)x[3]);
 }
 
-uint16_t read_u16(FILE *F) {
+uint16_t read_u16(FILE *F, char *label) {
   REQUIRES(F != NULL);
   uint8_t x[2];
   char* errmsg;
-  if (!next_byte(F, x, &errmsg) || !next_byte(F, x+1, &errmsg)) {
+  if (!next_byte(F, label, x, &errmsg) || !next_byte(F, label, x+1, &errmsg)) {
     if (errmsg == NULL) {
       fprintf(stderr, "Expected 2-byte sequence, found end of file.\n");
     } else {
@@ -124,11 +138,11 @@ uint16_t read_u16(FILE *F) {
   return ((uint16_t)x[0] << 8) | ((uint16_t)x[1]);
 }
 
-uint8_t read_u8(FILE *F) {
+uint8_t read_u8(FILE *F, char *label) {
   REQUIRES(F != NULL);
   uint8_t x;
   char* errmsg;
-  if (!next_byte(F, &x, &errmsg)) {
+  if (!next_byte(F, label, &x, &errmsg)) {
     if (errmsg == NULL) {
       fprintf(stderr, "Expected byte, found end of file.\n");
     } else {
@@ -150,13 +164,17 @@ struct bc0_file* read_program(char *filename) {
     exit(1);
   }
 
+  /* The most recent #<name> comment, kept here so loads on different
+   * threads don't share it */
+  char label[LABEL_MAX] = "";
+
   /* Check magic number */
   uint8_t x[4];
   char *errmsg;
-  if (!next_byte(F, x, &errmsg) ||
-      !next_byte(F, x+1, &errmsg) ||
-      !next_byte(F, x+2, &errmsg) ||
-      !next_byte(F, x+3, &errmsg)) {
+  if (!next_byte(F, label, x, &errmsg) ||
+      !next_byte(F, label, x+1, &errmsg) ||
+      !next_byte(F, label, x+2, &errmsg) ||
+      !next_byte(F, label, x+3, &errmsg)) {
     if (errmsg == NULL) {
       fprintf(stderr, "End of file reached while reading magic number.\n");
     } else {
@@ -179,52 +197,57 @@ struct bc0_file* read_program(char *filename) {
   bc0->magic = 0xC0C0FFEE;
   size_t i = 4;   /* current bc0_file byte position */
 
-  bc0->version = read_u16(F);
+  bc0->version = read_u16(F, label);
   i += 2;
 
-  bc0->int_count = read_u16(F);
+  bc0->int_count = read_u16(F, label);
   i += 2;
 
   bc0->int_pool = xcalloc(bc0->int_count, sizeof(int32_t));
   for (size_t j = 0; j < bc0->int_count; j++) {
-    bc0->int_pool[j] = read_u32(F);
+    bc0->int_pool[j] = read_u32(F, label);
     i += 4;
   }
 
-  bc0->string_count = read_u16(F);
+  bc0->string_count = read_u16(F, label);
   i += 2;
   bc0->string_pool = xcalloc(bc0->string_count, sizeof(char));
   for (size_t j = 0; j < bc0->string_count; j++) {
-    bc0->string_pool[j] = (char) read_u8(F);
+    bc0->string_pool[j] = (char) read_u8(F, label);
     i++;
   }
 
-  bc0->function_count = read_u16(F);
+  bc0->function_count = read_u16(F, label);
   i += 2;
   bc0->function_pool =
     xcalloc(bc0->function_count, sizeof(struct function_info));
   for (size_t j = 0; j < bc0->function_count; j++) {
-    bc0->function_pool[j].num_args = read_u16(F);
+    label[0] = '\0';
+    bc0->function_pool[j].num_args = read_u16(F, label);
     i += 2;
-    bc0->function_pool[j].num_vars = read_u16(F);
+    if (label[0] != '\0') {
+      bc0->function_pool[j].name = xcalloc(strlen(label) + 1, sizeof(char));
+      strcpy(bc0->function_pool[j].name, label);
+    }
+    bc0->function_pool[j].num_vars = read_u16(F, label);
     i += 2;
-    bc0->function_pool[j].code_length = read_u16(F);
+    bc0->function_pool[j].code_length = read_u16(F, label);
     i += 2;
     bc0->function_pool[j].code = 
       xcalloc(bc0->function_pool[j].code_length, sizeof(ubyte));
     for (size_t k = 0; k < bc0->function_pool[j].code_length; k++) {
-      bc0->function_pool[j].code[k] = read_u8(F);
+      bc0->function_pool[j].code[k] = read_u8(F, label);
       i++;
     }
   }
 
-  bc0->native_count = read_u16(F);
+  bc0->native_count = read_u16(F, label);
   i += 2;
   bc0->native_pool = xcalloc(bc0->native_count, sizeof(struct native_info));
   for (size_t j = 0; j < bc0->native_count; j++) {
-    bc0->native_pool[j].num_args = read_u16(F);
+    bc0->native_pool[j].num_args = read_u16(F, label);
     i += 2;
-    bc0->native_pool[j].function_table_index = read_u16(F);
+    bc0->native_pool[j].function_table_index = read_u16(F, label);
     i += 2;
   }
 
@@ -237,11 +260,12 @@ void free_program(struct bc0_file *program)
   REQUIRES(program != NULL);
 
   free(program->int_pool);
-  // Don't free the string pool, it's stack allocated
-  // free(program->string_pool);
+  free(program->string_pool);
 
-  for (size_t j = 0; j < program->function_count; j++)
+  for (size_t j = 0; j < program->function_count; j++) {
     free(program->function_pool[j].code);
+    free(program->function_pool[j].name);
+  }
   free(program->function_pool);
 
   free(program->native_pool);
@@ -28,12 +28,20 @@ static inline bool is_stack_segment(list *start, list *end)
   return true;
 }
 
+static inline size_t segment_length(list *start, list *end)
+{
+  size_t i = 0;
+  for (list *p = start; p != end; p = p->next) i++;
+  return i;
+}
+
 /* Stacks */ 
 
 typedef struct stack_header stack;
 struct stack_header {
   list *top;
   list *bottom;
+  size_t size;  /* number of elements, so that size queries are O(1) */
 };
 
 bool is_stack (stack *S) {
@@ -54,6 +62,7 @@ stack *stack_new() {
   /* Dummy node: does not need to be initialized! */
   S->top = p;
   S->bottom = p;
+  S->size = 0;
 
   ENSURES(is_stack(S));
   ENSURES(stack_empty(S));
@@ -67,6 +76,7 @@ void push(stack *S, stack_elem x) {
   p->data = x;
   p->next = S->top;
   S->top = p;
+  S->size++;
 
   ENSURES(is_stack(S) && !stack_empty(S));
 }
@@ -78,6 +88,7 @@ stack_elem pop(stack *S) {
   stack_elem x = S->top->data;  /* save old stack element to return */
   list *q = S->top;             /* save old list node to free */
   S->top = S->top->next;
+  S->size--;
   free(q);                      /* free old list node */
 
   ENSURES(is_stack(S));
@@ -87,9 +98,8 @@ stack_elem pop(stack *S) {
 size_t stack_size(stack *S) {
   REQUIRES(is_stack(S));
 
-  size_t i = 0;
-  for (list *p = S->top; p != S->bottom; p = p->next) i++;
-  return i;
+  ASSERT(S->size == segment_length(S->top, S->bottom));
+  return S->size;
 }
 
 void stack_free(stack *S, stack_elem_free_fn *elem_free) {